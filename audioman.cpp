@@ -30,12 +30,21 @@
 
 AudioManager::AudioManager() {
 	InitializeCriticalSection(&critsec);
-	_channelSeed = 0;
+	_played = false;
+	_outputRate = 44100;
+	_outputChannels = 2;
+	_outputFormat = kSampleFormatS16;
+
+	for (int i = 0; i < kMaxChannels; i++) {
+		_slots[i].state = kSlotFree;
+		_slots[i].generation = 0;
+	}
 }
 
 AudioManager::~AudioManager() {
-	stopAll();
 	//SDL_CloseAudio();
+
+	// The callback won't run anymore, so each Channel deletes its own stream
 	DeleteCriticalSection(&critsec);
 }
 
@@ -58,124 +67,238 @@ bool AudioManager::init() {
 	return true;
 }
 
-void AudioManager::play(AudioStream *stream) {
+uint AudioManager::setOutputFormat(uint rate, uint channels, SampleFormat format, uint nativeRate) {
+	if (rate == 0)
+		rate = nativeRate;
+
+	EnterCriticalSection(&critsec);
+
+	// Channels already playing have their converters set up. The rate
+	// converters only go up to 65535Hz.
+	if (!_played && rate < 65536 && (channels == 1 || channels == 2) && (format == kSampleFormatS16 || format == kSampleFormatFloat)) {
+		_outputRate = rate;
+		_outputChannels = channels;
+		_outputFormat = format;
+	}
+
+	LeaveCriticalSection(&critsec);
+	return _outputRate;
+}
+
+bool AudioManager::play(AudioStream *stream) {
 	AudioHandle handle;
-	play(stream, handle);
+	return play(stream, handle);
 }
 
-void AudioManager::play(AudioStream *stream, AudioHandle &handle, byte volume, int8 balance) {
+bool AudioManager::play(AudioStream *stream, AudioHandle &handle, byte volume, int8 balance) {
 	if (!stream)
-		return;
-
-	Channel *chan = new Channel(stream, /*_spec.freq*/44100, volume, balance);
+		return false;
 
 	EnterCriticalSection(&critsec);
-	handle._id = _channelSeed++;
+	reapSlots();
 
-	if (handle._id == 0xFFFFFFFF) {
-		// Probably could have better error handling, but I really hope
-		// this never happens :P
-		fprintf(stderr, "Rolling over AudioManager id's\n");
-		handle._id = 0;
+	int index = 0;
+	while (index < kMaxChannels && _slots[index].state != kSlotFree)
+		index++;
+
+	if (index == kMaxChannels) {
+		LeaveCriticalSection(&critsec);
+		fprintf(stderr, "Out of AudioManager channels\n");
+		return false;
 	}
 
-	_channels[handle._id] = chan;
+	Slot &slot = _slots[index];
+	slot.channel.start(stream, /*_spec.freq*/_outputRate, volume, balance);
+	handle._id = ((uint32)slot.generation << 16) | index;
+	_played = true;
+
+	// The channel has to be set up before the callback sees it playing
+	MemoryBarrier();
+	slot.state = kSlotPlaying;
+
 	LeaveCriticalSection(&critsec);
+	return true;
 }
 
 void AudioManager::stop(const AudioHandle &handle) {
-	if (handle._id == 0xFFFFFFFF)
-		return;
-
 	EnterCriticalSection(&critsec);
 
-	ChannelMap::iterator it = _channels.find(handle._id);
+	Slot *slot = findSlot(handle);
 
-	if (it != _channels.end()) {
-		delete it->second;
-		_channels.erase(it);
-	}
+	if (slot)
+		InterlockedCompareExchange(&slot->state, kSlotStopping, kSlotPlaying);
 
+	reapSlots();
 	LeaveCriticalSection(&critsec);
 }
 
 void AudioManager::stopAll() {
 	EnterCriticalSection(&critsec);
 
-	for (ChannelMap::iterator it = _channels.begin(); it != _channels.end(); it++)
-		delete it->second;
-
-	_channels.clear();
+	for (int i = 0; i < kMaxChannels; i++)
+		InterlockedCompareExchange(&_slots[i].state, kSlotStopping, kSlotPlaying);
 
+	reapSlots();
 	LeaveCriticalSection(&critsec);
 }
 
+void AudioManager::reapSlots() {
+	// Called with critsec held
+	for (int i = 0; i < kMaxChannels; i++) {
+		Slot &slot = _slots[i];
+
+		if (slot.state == kSlotDone) {
+			MemoryBarrier();
+			slot.channel.finish();
+			slot.generation++;
+			slot.state = kSlotFree;
+		}
+	}
+}
+
+AudioManager::Slot *AudioManager::findSlot(const AudioHandle &handle) {
+	// Called with critsec held
+	if (handle._id == 0xFFFFFFFF)
+		return 0;
+
+	uint index = handle._id & 0xFFFF;
+
+	if (index >= kMaxChannels)
+		return 0;
+
+	Slot &slot = _slots[index];
+
+	if (slot.generation != (handle._id >> 16) || slot.state == kSlotFree)
+		return 0;
+
+	return &slot;
+}
+
 void AudioManager::sdlCallback(void *manager, byte *samples, int len) {
 	((AudioManager *)manager)->callbackHandler(samples, len);
 }
 
 void AudioManager::callbackHandler(byte *samples, int len) {
-	assert((len % 4) == 0);
-	memset(samples, 0, len);
+	uint frameSize = _outputChannels * (_outputFormat == kSampleFormatFloat ? 4 : 2);
+	assert((len % frameSize) == 0);
+	uint frames = len / frameSize;
+
+	while (frames > 0) {
+		uint chunk = MIN<uint>(frames, kMixFrames);
+		memset(_bus, 0, chunk * 2 * sizeof(int32));
+		mixChannels(_bus, chunk);
+
+		if (_outputFormat == kSampleFormatFloat) {
+			// Floats have the headroom to go without clamping
+			float *dst = (float *)samples;
+
+			if (_outputChannels == 2) {
+				for (uint i = 0; i < chunk * 2; i++)
+					dst[i] = _bus[i] * (1.0f / (32768 << MIX_BUS_BITS));
+			} else {
+				for (uint i = 0; i < chunk; i++)
+					dst[i] = (_bus[i * 2] + _bus[i * 2 + 1]) * (1.0f / (65536 << MIX_BUS_BITS));
+			}
+		} else if (_outputChannels == 2) {
+			clampMixBus((int16 *)samples, _bus, chunk * 2);
+		} else {
+			int16 *dst = (int16 *)samples;
+
+			for (uint i = 0; i < chunk; i++)
+				dst[i] = CLIP<int32>((_bus[i * 2] + _bus[i * 2 + 1]) >> (MIX_BUS_BITS + 1), -32768, 32767);
+		}
 
-	EnterCriticalSection(&critsec);
+		samples += chunk * frameSize;
+		frames -= chunk;
+	}
+}
+
+void AudioManager::mixChannels(int32 *bus, uint frames) {
+	for (int i = 0; i < kMaxChannels; i++) {
+		Slot &slot = _slots[i];
+		LONG state = slot.state;
 
-	for (ChannelMap::iterator it = _channels.begin(); it != _channels.end(); it++) {
-		Channel *channel = it->second;
+		if (state != kSlotPlaying && state != kSlotStopping)
+			continue;
 
-		if (channel->endOfStream()) {
-			// TODO: Remove the channel
-		} else if (!channel->endOfData()) {
-			channel->mix((int16 *)samples, len >> 2);
+		// See the channel as play() set it up
+		MemoryBarrier();
+		Channel &channel = slot.channel;
+
+		if (state == kSlotStopping || channel.endOfStream()) {
+			// Hand it back for the control side to clean up
+			InterlockedExchange(&slot.state, kSlotDone);
+		} else if (!channel.endOfData()) {
+			channel.mix(bus, frames);
 		}
 	}
-
-	LeaveCriticalSection(&critsec);
 }
 
 void AudioManager::setVolume(const AudioHandle &handle, byte volume) {
-	if (handle._id == 0xFFFFFFFF)
-		return;
-
 	EnterCriticalSection(&critsec);
 
-	ChannelMap::iterator it = _channels.find(handle._id);
+	Slot *slot = findSlot(handle);
 
-	if (it != _channels.end())
-		it->second->setVolume(volume);
+	if (slot)
+		slot->channel.setVolume(volume);
 
 	LeaveCriticalSection(&critsec);
 }
 
 byte AudioManager::getVolume(const AudioHandle &handle) {
-	if (handle._id == 0xFFFFFFFF)
-		return 0;
-
 	byte volume = 0;
 
 	EnterCriticalSection(&critsec);
 
-	ChannelMap::iterator it = _channels.find(handle._id);
+	Slot *slot = findSlot(handle);
 
-	if (it != _channels.end())
-		volume = it->second->getVolume();
+	if (slot)
+		volume = slot->channel.getVolume();
 
 	LeaveCriticalSection(&critsec);
 
 	return volume;
 }
 
-AudioManager::Channel::Channel(AudioStream *stream, uint destFreq, byte volume, int8 balance) {
+AudioManager::Channel::Channel() {
+	_stream = 0;
+	_converter = 0;
+	_inRate = _outRate = 0;
+	_stereo = false;
+	_balance = 0;
+	_volume = 0;
+	_leftVolume = _rightVolume = 0;
+}
+
+AudioManager::Channel::~Channel() {
+	delete _stream;
+	delete _converter;
+}
+
+void AudioManager::Channel::start(AudioStream *stream, uint destFreq, byte volume, int8 balance) {
 	_stream = stream;
-	_converter = makeRateConverter(stream->getRate(), destFreq, stream->getChannels() == 2);
+
+	uint inRate = stream->getRate();
+	bool stereo = stream->getChannels() == 2;
+
+	if (_converter && inRate == _inRate && destFreq == _outRate && stereo == _stereo) {
+		_converter->reset();
+	} else {
+		delete _converter;
+		_converter = makeRateConverter(inRate, destFreq, stereo);
+		_inRate = inRate;
+		_outRate = destFreq;
+		_stereo = stereo;
+	}
+
 	_balance = CLIP<int8>(balance, -127, 127);
 	_volume = volume;
 	updateChannelVolumes();
 }
 
-AudioManager::Channel::~Channel() {
+void AudioManager::Channel::finish() {
 	delete _stream;
-	delete _converter;
+	_stream = 0;
 }
 
 void AudioManager::Channel::updateChannelVolumes() {
@@ -193,8 +316,8 @@ void AudioManager::Channel::updateChannelVolumes() {
 	}
 }
 
-void AudioManager::Channel::mix(int16 *samples, uint length) {
-	_converter->flow(*_stream, samples, length, _leftVolume, _rightVolume);
+void AudioManager::Channel::mix(int32 *bus, uint length) {
+	_converter->flow(*_stream, bus, length, _leftVolume, _rightVolume);
 }
 
 bool AudioManager::Channel::endOfStream() const {
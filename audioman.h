@@ -26,7 +26,6 @@
 #define AUDIOMAN_H
 
 
-#include <map>
 #include "types.h"
 #include <Windows.h>
 
@@ -60,9 +59,29 @@ public:
 		kMaxAudioManVolume = 0x100
 	};
 
+	enum SampleFormat {
+		kSampleFormatS16 = 0,
+		kSampleFormatFloat = 1
+	};
+
 	bool init();
-	void play(AudioStream *stream);
-	void play(AudioStream *stream, AudioHandle &handle, byte volume = kMaxChannelVolume, int8 balance = 0);
+
+	/**
+	 * Set what callbackHandler() delivers: the rate (0 for nativeRate), 1 or
+	 * 2 channels, and the sample format. Streams at the output rate are
+	 * passed through without resampling. Only possible before anything
+	 * plays; returns the output rate in use.
+	 */
+	uint setOutputFormat(uint rate, uint channels, SampleFormat format, uint nativeRate);
+	uint getOutputRate() const { return _outputRate; }
+
+	/**
+	 * Play the stream, which the manager deletes once it's done with it.
+	 * Returns false if every channel is busy, in which case the caller
+	 * keeps the stream.
+	 */
+	bool play(AudioStream *stream);
+	bool play(AudioStream *stream, AudioHandle &handle, byte volume = kMaxChannelVolume, int8 balance = 0);
 	void stop(const AudioHandle &handle);
 	void stopAll();
 
@@ -73,18 +92,38 @@ public:
 private:
 	static void sdlCallback(void *manager, byte *samples, int len);
 
+	uint _outputRate, _outputChannels;
+	SampleFormat _outputFormat;
+	bool _played;
+
+	// Every channel adds into this stereo 32-bit bus, which is then
+	// clamped or converted once into the output format
+	enum { kMixFrames = 1024 };
+	int32 _bus[kMixFrames * 2];
+
 	//SDL_AudioSpec _spec;
 	//SDL_mutex *_mutex;
+
+	// Serializes play/stop/volume callers. callbackHandler() never takes it.
 	CRITICAL_SECTION critsec;
 
 	struct Channel {
 	public:
-		Channel(AudioStream *stream, uint destFreq, byte volume, int8 balance);
+		Channel();
 		~Channel();
 
+		/**
+		 * Set up for a new stream. The rate converter is kept from the
+		 * previous stream if it fits, so this rarely allocates.
+		 */
+		void start(AudioStream *stream, uint destFreq, byte volume, int8 balance);
+
+		/** Delete the stream, keeping the converter for the next start(). */
+		void finish();
+
 		bool endOfStream() const;
 		bool endOfData() const;
-		void mix(int16 *samples, uint length);
+		void mix(int32 *bus, uint length);
 
 		void setVolume(byte volume);
 		byte getVolume() const { return _volume; }
@@ -92,6 +131,8 @@ private:
 	protected:
 		AudioStream *_stream;
 		RateConverter *_converter;
+		uint _inRate, _outRate;
+		bool _stereo;
 		int8 _balance;
 		byte _volume;
 		uint16 _leftVolume, _rightVolume;
@@ -100,9 +141,34 @@ private:
 		void updateChannelVolumes();
 	};
 
-	typedef std::map<uint, Channel *> ChannelMap;
-	ChannelMap _channels;
-	uint _channelSeed;
+	/**
+	 * A fixed table of channels. Playing channels belong to the callback.
+	 * Once a channel is stopped or its stream ends, the callback marks it
+	 * done and never looks at it again. The next play/stop call then
+	 * deletes the stream, so the callback never frees anything.
+	 */
+	enum {
+		kMaxChannels = 32
+	};
+
+	enum SlotState {
+		kSlotFree,
+		kSlotPlaying,
+		kSlotStopping, // stop() asked, the callback hasn't let go yet
+		kSlotDone
+	};
+
+	struct Slot {
+		Channel channel;
+		volatile LONG state;
+		uint16 generation; // bumped on reuse, so old handles stop matching
+	};
+
+	Slot _slots[kMaxChannels];
+	void reapSlots();
+	Slot *findSlot(const AudioHandle &handle);
+
+	void mixChannels(int32 *bus, uint frames);
 };
 
 #endif
@@ -27,6 +27,8 @@
 #include <assert.h>
 #include <queue>
 #include "audiostream.h"
+#include "spscqueue.h"
+#include "util.h"
 #include <Windows.h>
 
 
@@ -63,19 +65,28 @@ private:
 	bool _finished;
 
 	/**
-	 * A mutex to avoid access problems (causing e.g. corruption of
-	 * the linked list) in thread aware environments.
+	 * The streams still to be played. The decoder pushes, the audio
+	 * callback pops, and neither waits on the other.
 	 */
-	CRITICAL_SECTION critsec;
+	SPSCQueue<AudioStream *> _queue;
 
 	/**
-	 * The queue of audio streams.
+	 * Every stream queued and not disposed of yet, oldest first. Only the
+	 * queuing thread touches this; it disposes of the streams the callback
+	 * finished with, so the callback never frees anything.
 	 */
-	std::queue<StreamHolder> _queue;
+	std::queue<StreamHolder> _queued;
+	uint32 _disposedCount;
+
+	volatile LONG _queuedCount;
+	volatile LONG _playedCount;
+
+	void disposePlayed();
 
 public:
 	QueuingAudioStreamImpl(int rate, int channels)  : _rate(rate), _channels(channels), _finished(false) {
-		InitializeCriticalSection(&critsec);
+		_disposedCount = 0;
+		_queuedCount = _playedCount = 0;
 	}
 	~QueuingAudioStreamImpl();
 
@@ -83,10 +94,7 @@ public:
 	virtual int readBuffer(int16 *buffer, const int numSamples);
 	virtual int getChannels() const { return _channels; }
 	virtual int getRate() const { return _rate; }
-	virtual bool endOfData() const {
-		// TODO: Lock mutex?
-		return _queue.empty();
-	}
+	virtual bool endOfData() const { return _queue.empty(); }
 	virtual bool endOfStream() const { return _finished && _queue.empty(); }
 
 	// Implement the QueuingAudioStream API
@@ -94,19 +102,29 @@ public:
 	virtual void finish() { _finished = true; }
 
 	uint32 getQueuedStreamCount() const {
-		// TODO: Lock mutex?
-		return _queue.size();
+		return _queuedCount - _playedCount;
 	}
 };
 
 QueuingAudioStreamImpl::~QueuingAudioStreamImpl() {
-	DeleteCriticalSection(&critsec);
+	while (!_queued.empty()) {
+		StreamHolder tmp = _queued.front();
+		_queued.pop();
+		if (tmp._disposeAfterUse)
+			delete tmp._stream;
+	}
+}
+
+void QueuingAudioStreamImpl::disposePlayed() {
+	uint32 playedCount = _playedCount;
 
-	while (!_queue.empty()) {
-		StreamHolder tmp = _queue.front();
-		_queue.pop();
+	while (_disposedCount < playedCount) {
+		StreamHolder tmp = _queued.front();
+		_queued.pop();
 		if (tmp._disposeAfterUse)
 			delete tmp._stream;
+
+		_disposedCount++;
 	}
 }
 
@@ -115,30 +133,27 @@ void QueuingAudioStreamImpl::queueAudioStream(AudioStream *stream, bool disposeA
 	assert(stream->getRate() == getRate());
 	assert(stream->getChannels() == getChannels());
 
-	EnterCriticalSection(&critsec);
-	_queue.push(StreamHolder(stream, disposeAfterUse));
-	LeaveCriticalSection(&critsec);
+	disposePlayed();
+
+	_queued.push(StreamHolder(stream, disposeAfterUse));
+	_queue.push(stream);
+	InterlockedIncrement(&_queuedCount);
 }
 
 int QueuingAudioStreamImpl::readBuffer(int16 *buffer, const int numSamples) {
 	int samplesDecoded = 0;
 
-	EnterCriticalSection(&critsec);
-
 	while (samplesDecoded < numSamples && !_queue.empty()) {
-		AudioStream *stream = _queue.front()._stream;
+		AudioStream *stream = _queue.front();
 		samplesDecoded += stream->readBuffer(buffer + samplesDecoded, numSamples - samplesDecoded);
 
 		if (stream->endOfData()) {
-			StreamHolder tmp = _queue.front();
+			// The queuing thread disposes of it from here on
 			_queue.pop();
-			if (tmp._disposeAfterUse)
-				delete stream;
+			InterlockedIncrement(&_playedCount);
 		}
 	}
 
-	LeaveCriticalSection(&critsec);
-
 	return samplesDecoded;
 }
 
@@ -146,3 +161,79 @@ QueuingAudioStream *makeQueuingAudioStream(int rate, int channels) {
 	return new QueuingAudioStreamImpl(rate, channels);
 }
 
+class RingAudioStreamImpl : public RingAudioStream {
+public:
+	RingAudioStreamImpl(int rate, int channels, uint32 blockSize, uint32 blockCount);
+	~RingAudioStreamImpl() { delete[] _samples; }
+
+	// Implement the AudioStream API
+	virtual int readBuffer(int16 *buffer, const int numSamples);
+	virtual int getChannels() const { return _channels; }
+	virtual int getRate() const { return _rate; }
+	virtual bool endOfData() const { return _readPos == _writePos; }
+	virtual bool endOfStream() const { return _finished && endOfData(); }
+
+	// Implement the RingAudioStream API
+	virtual int16 *getWriteBlock();
+	virtual void commitWriteBlock();
+	virtual void finish() { _finished = true; }
+
+private:
+	const int _rate;
+	const int _channels;
+	bool _finished;
+
+	int16 *_samples;
+	uint32 _blockSize;
+	uint32 _size; // power of two, so the positions can wrap around freely
+
+	// Samples written and read so far. Each side only moves its own.
+	volatile uint32 _writePos, _readPos;
+};
+
+RingAudioStreamImpl::RingAudioStreamImpl(int rate, int channels, uint32 blockSize, uint32 blockCount) : _rate(rate), _channels(channels), _finished(false) {
+	assert((blockSize & (blockSize - 1)) == 0);
+
+	_blockSize = blockSize;
+	_size = blockSize;
+	while (_size < blockSize * blockCount)
+		_size <<= 1;
+
+	_samples = new int16[_size];
+	_writePos = _readPos = 0;
+}
+
+int16 *RingAudioStreamImpl::getWriteBlock() {
+	if (_writePos - _readPos + _blockSize > _size)
+		return 0;
+
+	return _samples + (_writePos & (_size - 1));
+}
+
+void RingAudioStreamImpl::commitWriteBlock() {
+	// The samples have to be visible before the new position is
+	MemoryBarrier();
+	_writePos += _blockSize;
+}
+
+int RingAudioStreamImpl::readBuffer(int16 *buffer, const int numSamples) {
+	uint32 readPos = _readPos;
+	uint32 available = _writePos - readPos;
+	MemoryBarrier();
+
+	uint32 samples = MIN<uint32>(numSamples, available);
+	uint32 offset = readPos & (_size - 1);
+	uint32 firstPart = MIN<uint32>(samples, _size - offset);
+
+	memcpy(buffer, _samples + offset, firstPart * 2);
+	memcpy(buffer + firstPart, _samples, (samples - firstPart) * 2);
+
+	// Done reading before the writer may reuse the space
+	MemoryBarrier();
+	_readPos = readPos + samples;
+	return samples;
+}
+
+RingAudioStream *makeRingAudioStream(int rate, int channels, uint32 blockSize, uint32 blockCount) {
+	return new RingAudioStreamImpl(rate, channels, blockSize, blockCount);
+}
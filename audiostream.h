@@ -107,4 +107,30 @@ public:
  */
 QueuingAudioStream *makeQueuingAudioStream(int rate, int channels);
 
+/**
+ * A stream that plays native 16-bit samples from a fixed ring of blocks.
+ * One thread decodes whole blocks straight into the ring while the audio
+ * callback reads them back, and neither waits on the other.
+ */
+class RingAudioStream : public AudioStream {
+public:
+	/**
+	 * Return the next block to write samples into, or 0 if the ring is full
+	 * because nobody has been reading. Writing thread only.
+	 */
+	virtual int16 *getWriteBlock() = 0;
+
+	/** Make the block from getWriteBlock() available for playback. */
+	virtual void commitWriteBlock() = 0;
+
+	/** Mark this stream as finished, like QueuingAudioStream::finish(). */
+	virtual void finish() = 0;
+};
+
+/**
+ * Factory function for a RingAudioStream holding at least blockCount blocks
+ * of blockSize samples each. blockSize must be a power of two.
+ */
+RingAudioStream *makeRingAudioStream(int rate, int channels, uint32 blockSize, uint32 blockCount);
+
 #endif
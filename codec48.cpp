@@ -24,7 +24,281 @@
 #include <stdio.h>
 #include <string.h>
 #include "codec48.h"
+#include "simd.h"
 #include "util.h"
+#include "workerpool.h"
+
+// Scalar block kernels
+
+static void copyBlockScalar(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i++) {
+		*((uint32 *)(dst + pitch * i)) = *((const uint32 *)(src + pitch * i));
+		*((uint32 *)(dst + pitch * i + 4)) = *((const uint32 *)(src + pitch * i + 4));
+	}
+}
+
+static void scaleBlockScalar(byte *dst, const byte *src, int pitch) {
+	// This is doing a 2x scale of data
+
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			uint16 pixels = src[j];
+			pixels = (pixels << 8) | pixels;
+			*((uint16 *)(dst + j * 2)) = pixels;
+			*((uint16 *)(dst + pitch + j * 2)) = pixels;
+		}
+
+		src += 4;
+		dst += pitch * 2;
+	}
+}
+
+static void copyQuadsScalar(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int k = 0; k < 4; k++) {
+		int x = (k & 1) * 4;
+		int y = (k >> 1) * 4;
+
+		for (int i = y; i < y + 4; i++)
+			*((uint32 *)(dst + pitch * i + x)) = *((const uint32 *)(src + offsets[k] + pitch * i + x));
+	}
+}
+
+static void copyPairsScalar(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int k = 0; k < 16; k++) {
+		int x = (k & 3) * 2;
+		int y = (k >> 2) * 2;
+
+		*((uint16 *)(dst + pitch * y + x)) = *((const uint16 *)(src + offsets[k] + pitch * y + x));
+		*((uint16 *)(dst + pitch * (y + 1) + x)) = *((const uint16 *)(src + offsets[k] + pitch * (y + 1) + x));
+	}
+}
+
+static void rawBlockScalar(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i++) {
+		*((uint32 *)(dst + pitch * i)) = *((const uint32 *)(src + i * 8));
+		*((uint32 *)(dst + pitch * i + 4)) = *((const uint32 *)(src + i * 8 + 4));
+	}
+}
+
+static const Codec48Kernels s_scalarKernels = {
+	copyBlockScalar,
+	scaleBlockScalar,
+	copyQuadsScalar,
+	copyPairsScalar,
+	rawBlockScalar
+};
+
+#ifdef SMUSH_SIMD_SSE2
+
+// SSE2 block kernels
+// A block row is 8 bytes, so each row becomes a single 64-bit move.
+
+static inline void storeRows(byte *dst, int pitch, __m128i rows) {
+	_mm_storel_epi64((__m128i *)dst, rows);
+	_mm_storel_epi64((__m128i *)(dst + pitch), _mm_unpackhi_epi64(rows, rows));
+}
+
+static void copyBlockSSE2(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i++)
+		_mm_storel_epi64((__m128i *)(dst + pitch * i), _mm_loadl_epi64((const __m128i *)(src + pitch * i)));
+}
+
+static void scaleBlockSSE2(byte *dst, const byte *src, int pitch) {
+	__m128i pixels = _mm_loadu_si128((const __m128i *)src);
+	__m128i top = _mm_unpacklo_epi8(pixels, pixels);
+	__m128i bottom = _mm_unpackhi_epi8(pixels, pixels);
+
+	storeRows(dst, pitch, _mm_unpacklo_epi64(top, top));
+	storeRows(dst + pitch * 2, pitch, _mm_unpackhi_epi64(top, top));
+	storeRows(dst + pitch * 4, pitch, _mm_unpacklo_epi64(bottom, bottom));
+	storeRows(dst + pitch * 6, pitch, _mm_unpackhi_epi64(bottom, bottom));
+}
+
+static void copyQuadsSSE2(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int k = 0; k < 4; k += 2) {
+		const byte *left = src + offsets[k] + pitch * k * 2;
+		const byte *right = src + offsets[k + 1] + pitch * k * 2 + 4;
+		byte *row = dst + pitch * k * 2;
+
+		for (int i = 0; i < 4; i++) {
+			__m128i l = _mm_cvtsi32_si128(*((const int32 *)(left + pitch * i)));
+			__m128i r = _mm_cvtsi32_si128(*((const int32 *)(right + pitch * i)));
+			_mm_storel_epi64((__m128i *)(row + pitch * i), _mm_unpacklo_epi32(l, r));
+		}
+	}
+}
+
+static void copyPairsSSE2(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int i = 0; i < 8; i++) {
+		const int *rowOffsets = offsets + (i >> 1) * 4;
+		const byte *srcRow = src + pitch * i;
+
+		__m128i row = _mm_cvtsi32_si128(*((const uint16 *)(srcRow + rowOffsets[0])));
+		row = _mm_insert_epi16(row, *((const uint16 *)(srcRow + rowOffsets[1] + 2)), 1);
+		row = _mm_insert_epi16(row, *((const uint16 *)(srcRow + rowOffsets[2] + 4)), 2);
+		row = _mm_insert_epi16(row, *((const uint16 *)(srcRow + rowOffsets[3] + 6)), 3);
+		_mm_storel_epi64((__m128i *)(dst + pitch * i), row);
+	}
+}
+
+static void rawBlockSSE2(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i += 2)
+		storeRows(dst + pitch * i, pitch, _mm_loadu_si128((const __m128i *)(src + i * 8)));
+}
+
+static const Codec48Kernels s_sse2Kernels = {
+	copyBlockSSE2,
+	scaleBlockSSE2,
+	copyQuadsSSE2,
+	copyPairsSSE2,
+	rawBlockSSE2
+};
+
+#endif
+
+#ifdef SMUSH_SIMD_AVX2
+
+// AVX2 block kernels
+// Only the kernels that read packed input gain from 256-bit registers; the
+// copies gather 8 (or fewer) bytes per row from scattered sources, so those
+// stay on the SSE2 versions.
+
+SMUSH_TARGET_AVX2 static void scaleBlockAVX2(byte *dst, const byte *src, int pitch) {
+	__m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+	pixels = _mm256_or_si256(pixels, _mm256_slli_epi16(pixels, 8));
+
+	__m128i top = _mm256_castsi256_si128(pixels);
+	__m128i bottom = _mm256_extracti128_si256(pixels, 1);
+
+	storeRows(dst, pitch, _mm_unpacklo_epi64(top, top));
+	storeRows(dst + pitch * 2, pitch, _mm_unpackhi_epi64(top, top));
+	storeRows(dst + pitch * 4, pitch, _mm_unpacklo_epi64(bottom, bottom));
+	storeRows(dst + pitch * 6, pitch, _mm_unpackhi_epi64(bottom, bottom));
+}
+
+SMUSH_TARGET_AVX2 static void rawBlockAVX2(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i += 4) {
+		__m256i rows = _mm256_loadu_si256((const __m256i *)(src + i * 8));
+		storeRows(dst + pitch * i, pitch, _mm256_castsi256_si128(rows));
+		storeRows(dst + pitch * (i + 2), pitch, _mm256_extracti128_si256(rows, 1));
+	}
+}
+
+static const Codec48Kernels s_avx2Kernels = {
+	copyBlockSSE2,
+	scaleBlockAVX2,
+	copyQuadsSSE2,
+	copyPairsSSE2,
+	rawBlockAVX2
+};
+
+#endif
+
+#ifdef SMUSH_SIMD_NEON
+
+// NEON block kernels
+
+static inline void storeRows(byte *dst, int pitch, uint8x16_t rows) {
+	vst1_u8(dst, vget_low_u8(rows));
+	vst1_u8(dst + pitch, vget_high_u8(rows));
+}
+
+static void copyBlockNEON(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i++)
+		vst1_u8(dst + pitch * i, vld1_u8(src + pitch * i));
+}
+
+static void scaleBlockNEON(byte *dst, const byte *src, int pitch) {
+	uint8x16_t pixels = vld1q_u8(src);
+	uint8x16x2_t scaled = vzipq_u8(pixels, pixels);
+
+	for (int i = 0; i < 2; i++) {
+		uint8x8_t first = vget_low_u8(scaled.val[i]);
+		uint8x8_t second = vget_high_u8(scaled.val[i]);
+		byte *row = dst + pitch * i * 4;
+
+		vst1_u8(row, first);
+		vst1_u8(row + pitch, first);
+		vst1_u8(row + pitch * 2, second);
+		vst1_u8(row + pitch * 3, second);
+	}
+}
+
+static void copyQuadsNEON(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int k = 0; k < 4; k += 2) {
+		const byte *left = src + offsets[k] + pitch * k * 2;
+		const byte *right = src + offsets[k + 1] + pitch * k * 2 + 4;
+		byte *row = dst + pitch * k * 2;
+
+		for (int i = 0; i < 4; i++) {
+			uint32x2_t pixels = vdup_n_u32(0);
+			pixels = vld1_lane_u32((const uint32_t *)(left + pitch * i), pixels, 0);
+			pixels = vld1_lane_u32((const uint32_t *)(right + pitch * i), pixels, 1);
+			vst1_u8(row + pitch * i, vreinterpret_u8_u32(pixels));
+		}
+	}
+}
+
+static void copyPairsNEON(byte *dst, const byte *src, const int *offsets, int pitch) {
+	for (int i = 0; i < 8; i++) {
+		const int *rowOffsets = offsets + (i >> 1) * 4;
+		const byte *srcRow = src + pitch * i;
+
+		uint16x4_t row = vdup_n_u16(0);
+		row = vld1_lane_u16((const uint16_t *)(srcRow + rowOffsets[0]), row, 0);
+		row = vld1_lane_u16((const uint16_t *)(srcRow + rowOffsets[1] + 2), row, 1);
+		row = vld1_lane_u16((const uint16_t *)(srcRow + rowOffsets[2] + 4), row, 2);
+		row = vld1_lane_u16((const uint16_t *)(srcRow + rowOffsets[3] + 6), row, 3);
+		vst1_u8(dst + pitch * i, vreinterpret_u8_u16(row));
+	}
+}
+
+static void rawBlockNEON(byte *dst, const byte *src, int pitch) {
+	for (int i = 0; i < 8; i += 2)
+		storeRows(dst + pitch * i, pitch, vld1q_u8(src + i * 8));
+}
+
+static const Codec48Kernels s_neonKernels = {
+	copyBlockNEON,
+	scaleBlockNEON,
+	copyQuadsNEON,
+	copyPairsNEON,
+	rawBlockNEON
+};
+
+#endif
+
+static const Codec48Kernels *s_kernels = &s_scalarKernels;
+
+void bindCodec48Kernels(CPUTier tier) {
+	switch (tier) {
+#ifdef SMUSH_SIMD_AVX2
+	case kCPUTierAVX512:
+	case kCPUTierAVX2:
+		s_kernels = &s_avx2Kernels;
+		break;
+#endif
+#ifdef SMUSH_SIMD_SSE2
+	case kCPUTierSSSE3:
+	case kCPUTierSSE2:
+		s_kernels = &s_sse2Kernels;
+		break;
+#endif
+#ifdef SMUSH_SIMD_NEON
+	case kCPUTierNEON:
+		s_kernels = &s_neonKernels;
+		break;
+#endif
+	default:
+		s_kernels = &s_scalarKernels;
+	}
+}
+
+// Number of payload bytes following each decode3() opcode
+static inline int getPayloadSize(byte opcode) {
+	static const byte sizes[] = { 64, 32, 16, 16, 8, 4, 4, 2, 1 };
+	return (opcode < 0xF7) ? 0 : sizes[opcode - 0xF7];
+}
 
 Codec48Decoder::Codec48Decoder(int width, int height) {
 	_width = width;
@@ -48,15 +322,94 @@ Codec48Decoder::Codec48Decoder(int width, int height) {
 	_tableLastIndex = -1;
 
 	_interTable = 0;
+
+	_deferred = new byte[_blockX * _blockY];
+	_dirty = new byte[_blockX * _blockY];
+	memset(_dirty, 1, _blockX * _blockY);
+	_flipped = false;
+	_prevSeqNb = 0;
+	_pool = 0;
+	_bandCount = 0;
+	setThreadCount(0);
 }
 
 Codec48Decoder::~Codec48Decoder() {
+	delete _pool;
+	delete[] _deferred;
+	delete[] _dirty;
 	delete[] _deltaBuf[0];
 	delete[] _offsetTable;
 	delete[] _interTable;
 }
 
-bool Codec48Decoder::decode(byte *dst, const byte *src) {
+void Codec48Decoder::setThreadCount(int threadCount) {
+	if (threadCount <= 0)
+		threadCount = WorkerPool::getProcessorCount();
+
+	// Don't bother splitting frames into bands too small to pay for the handoff
+	int bandCount = CLIP(threadCount, 1, MAX(_blockY / kMinBandRows, 1));
+
+	if (bandCount == _bandCount)
+		return;
+
+	delete _pool;
+	_pool = (bandCount > 1) ? new WorkerPool(bandCount - 1) : 0;
+
+	_bandCount = bandCount;
+	_bands.resize(bandCount);
+
+	for (int i = 0; i < bandCount; i++) {
+		_bands[i].firstRow = _blockY * i / bandCount;
+		_bands[i].lastRow = _blockY * (i + 1) / bandCount;
+	}
+}
+
+uint32 Codec48Decoder::getStateSize() const {
+	return _frameSize * 2 + (_interTable ? 65536 : 0);
+}
+
+void Codec48Decoder::saveState(State &state) const {
+	if (!state._deltaBuf)
+		state._deltaBuf = new byte[_frameSize * 2];
+
+	memcpy(state._deltaBuf, _deltaBuf[0], _frameSize * 2);
+
+	if (_interTable) {
+		if (!state._interTable)
+			state._interTable = new byte[65536];
+
+		memcpy(state._interTable, _interTable, 65536);
+	} else {
+		delete[] state._interTable;
+		state._interTable = 0;
+	}
+
+	state._curBuf = _curBuf;
+	state._prevSeqNb = _prevSeqNb;
+}
+
+void Codec48Decoder::restoreState(const State &state) {
+	memcpy(_deltaBuf[0], state._deltaBuf, _frameSize * 2);
+
+	if (state._interTable) {
+		if (!_interTable)
+			_interTable = new byte[65536];
+
+		memcpy(_interTable, state._interTable, 65536);
+	} else {
+		delete[] _interTable;
+		_interTable = 0;
+	}
+
+	_curBuf = state._curBuf;
+	_prevSeqNb = state._prevSeqNb;
+
+	// Whatever was shown before has nothing to do with this frame
+	memset(_dirty, 1, _blockX * _blockY);
+	_flipped = false;
+}
+
+bool Codec48Decoder::decode(const byte *src) {
 	// The header is identical to codec 37, except the flags field is somewhat different
 
 	const byte *gfxData = src + 0x10;
@@ -90,6 +443,10 @@ bool Codec48Decoder::decode(byte *dst, const byte *src) {
 		}
 	}
 
+	// 1 or 0 if the whole frame did or didn't change, -1 once decode3()
+	// has filled in the dirty map block by block
+	int changed = 1;
+
 	switch (src[0]) {
 	case 0:
 		// Raw frame
@@ -102,23 +459,34 @@ bool Codec48Decoder::decode(byte *dst, const byte *src) {
 	case 3:
 		// 8x8 block encoding
 		if (!(seqNb && seqNb != _prevSeqNb + 1)) {
-			if (seqNb & 1 || !(src[12] & 1) || src[12] & 0x10)
+			_flipped = (seqNb & 1 || !(src[12] & 1) || src[12] & 0x10);
+
+			if (_flipped)
 				_curBuf ^= 1;
 
+			// Clearing the buffers invalidates whatever the blocks copy
+			_flipped = _flipped && seqNb != 0;
 			decode3(_deltaBuf[_curBuf], gfxData, _deltaBuf[_curBuf ^ 1] - _deltaBuf[_curBuf]);
+			changed = -1;
+		} else {
+			changed = 0;
 		}
 		break;
 	case 5:
 		// Some other encoding, but it's unused. (Good)
 		printf("WARNING: codec 48 frame type 5 encountered! Please report!\n");
+		changed = (seqNb == 0);
 		break;
 	default:
 		printf("Unknown codec 48 frame type %d\n", src[0]);
+		changed = (seqNb == 0);
 		break;
 	}
 
+	if (changed >= 0)
+		memset(_dirty, changed, _blockX * _blockY);
+
 	_prevSeqNb = seqNb;
-	memcpy(dst, _deltaBuf[_curBuf], _pitch * _height);
 	return true;
 }
 
@@ -269,255 +637,196 @@ void Codec48Decoder::makeTable(int pitch, int index) {
 	}
 }
 
-void Codec48Decoder::decode3(byte *dst, const byte *src, int bufOffset) {
-	for (int i = 0; i < _blockY; i++) {
+void Codec48Decoder::decodeBlock(byte *dst, const byte *src, byte opcode, int bufOffset) {
+	int offsets[16];
+
+	switch (opcode) {
+	case 0xFF: {
+		// Interpolate a 4x4 block based on 1 pixel, then scale to 8x8
+		byte scaleBuffer[16];
+		scaleBuffer[15] = src[0];
+		scaleBuffer[7] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[15]];
+		scaleBuffer[3] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[7]];
+		scaleBuffer[11] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[7]];
+
+		scaleBuffer[1] = _interTable[(dst[-1] << 8) | scaleBuffer[3]];
+		scaleBuffer[0] = _interTable[(dst[-1] << 8) | scaleBuffer[1]];
+		scaleBuffer[2] = _interTable[(scaleBuffer[3] << 8) | scaleBuffer[1]];
+
+		scaleBuffer[5] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[7]];
+		scaleBuffer[4] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[5]];
+		scaleBuffer[6] = _interTable[(scaleBuffer[7] << 8) | scaleBuffer[5]];
+
+		scaleBuffer[9] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[11]];
+		scaleBuffer[8] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[9]];
+		scaleBuffer[10] = _interTable[(scaleBuffer[11] << 8) | scaleBuffer[9]];
+
+		scaleBuffer[13] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[15]];
+		scaleBuffer[12] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[13]];
+		scaleBuffer[14] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[13]];
+
+		s_kernels->scaleBlock(dst, scaleBuffer, _pitch);
+		break;
+	}
+	case 0xFE:
+		// Copy a block using an absolute offset
+		s_kernels->copyBlock(dst, dst + bufOffset + (int16)READ_LE_UINT16(src), _pitch);
+		break;
+	case 0xFD: {
+		// Interpolate a 4x4 block based on 4 pixels, then scale to 8x8
+		byte scaleBuffer[16];
+		scaleBuffer[5] = src[0];
+		scaleBuffer[7] = src[1];
+		scaleBuffer[13] = src[2];
+		scaleBuffer[15] = src[3];
+
+		scaleBuffer[1] = _interTable[(dst[-_pitch + 3] << 8) | scaleBuffer[5]];
+		scaleBuffer[3] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[7]];
+		scaleBuffer[11] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[7]];
+		scaleBuffer[9] = _interTable[(scaleBuffer[13] << 8) | scaleBuffer[5]];
+
+		scaleBuffer[0] = _interTable[(dst[-1] << 8) | scaleBuffer[1]];
+		scaleBuffer[2] = _interTable[(scaleBuffer[3] << 8) | scaleBuffer[1]];
+		scaleBuffer[4] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[5]];
+		scaleBuffer[6] = _interTable[(scaleBuffer[7] << 8) | scaleBuffer[5]];
+
+		scaleBuffer[8] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[9]];
+		scaleBuffer[10] = _interTable[(scaleBuffer[11] << 8) | scaleBuffer[9]];
+		scaleBuffer[12] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[13]];
+		scaleBuffer[14] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[13]];
+		
+		s_kernels->scaleBlock(dst, scaleBuffer, _pitch);
+		break;
+	}
+	case 0xFC:
+		// Copy 4 4x4 blocks using the offset table
+		for (int k = 0; k < 4; k++)
+			offsets[k] = _offsetTable[src[k]];
+
+		s_kernels->copyQuads(dst, dst + bufOffset, offsets, _pitch);
+		break;
+	case 0xFB:
+		// Copy 4 4x4 blocks using absolute offsets
+		for (int k = 0; k < 4; k++)
+			offsets[k] = (int16)READ_LE_UINT16(src + k * 2);
+
+		s_kernels->copyQuads(dst, dst + bufOffset, offsets, _pitch);
+		break;
+	case 0xFA:
+		// Scale a 4x4 block to an 8x8 block
+		s_kernels->scaleBlock(dst, src, _pitch);
+		break;
+	case 0xF9:
+		// Copy 16 2x2 blocks using the offset table
+		for (int k = 0; k < 16; k++)
+			offsets[k] = _offsetTable[src[k]];
+
+		s_kernels->copyPairs(dst, dst + bufOffset, offsets, _pitch);
+		break;
+	case 0xF8:
+		// Copy 16 2x2 blocks using absolute offsets
+		for (int k = 0; k < 16; k++)
+			offsets[k] = (int16)READ_LE_UINT16(src + k * 2);
+
+		s_kernels->copyPairs(dst, dst + bufOffset, offsets, _pitch);
+		break;
+	case 0xF7:
+		// Raw 8x8 block
+		s_kernels->rawBlock(dst, src, _pitch);
+		break;
+	default:
+		// Copy a block using the offset table
+		s_kernels->copyBlock(dst, dst + bufOffset + _offsetTable[opcode], _pitch);
+		break;
+	}
+}
+
+bool Codec48Decoder::copiesPrevious(const byte *src, byte opcode) const {
+	// Blocks taken from the same place in the other buffer, which after a
+	// buffer swap is the previous frame, are unchanged
+
+	switch (opcode) {
+	case 0xFF:
+	case 0xFD:
+	case 0xFA:
+	case 0xF7:
+		return false;
+	case 0xFE:
+		return READ_LE_UINT16(src) == 0;
+	case 0xFC:
+	case 0xF9:
+		for (int k = 0; k < getPayloadSize(opcode); k++)
+			if (_offsetTable[src[k]] != 0)
+				return false;
+
+		return true;
+	case 0xFB:
+	case 0xF8:
+		for (int k = 0; k < getPayloadSize(opcode); k++)
+			if (src[k] != 0)
+				return false;
+
+		return true;
+	default:
+		return _offsetTable[opcode] == 0;
+	}
+}
+
+void Codec48Decoder::decodeBandJob(void *param, int index) {
+	((Codec48Decoder *)param)->decodeBand(index);
+}
+
+void Codec48Decoder::decodeBand(int index) {
+	Band &band = _bands[index];
+	const byte *src = band.src;
+	byte *dst = _bandDst + band.firstRow * _pitch * 8;
+	int bufOffset = _bandOffset;
+
+	band.deferred.clear();
+
+	for (int i = band.firstRow; i < band.lastRow; i++) {
+		// Which blocks of this row and the one above are left for the fixup pass
+		byte *deferred = _deferred + i * _blockX;
+		const byte *deferredAbove = (i > band.firstRow) ? deferred - _blockX : 0;
+		byte *dirty = _dirty + i * _blockX;
+
 		for (int j = 0; j < _blockX; j++) {
 			byte opcode = *src++;
-			
-
-			switch (opcode) {
-			case 0xFF: {
-				// Interpolate a 4x4 block based on 1 pixel, then scale to 8x8
-				byte scaleBuffer[16];
-				scaleBuffer[15] = *src++;
-				scaleBuffer[7] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[15]];
-				scaleBuffer[3] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[7]];
-				scaleBuffer[11] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[7]];
-
-				scaleBuffer[1] = _interTable[(dst[-1] << 8) | scaleBuffer[3]];
-				scaleBuffer[0] = _interTable[(dst[-1] << 8) | scaleBuffer[1]];
-				scaleBuffer[2] = _interTable[(scaleBuffer[3] << 8) | scaleBuffer[1]];
-
-				scaleBuffer[5] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[7]];
-				scaleBuffer[4] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[5]];
-				scaleBuffer[6] = _interTable[(scaleBuffer[7] << 8) | scaleBuffer[5]];
-
-				scaleBuffer[9] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[11]];
-				scaleBuffer[8] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[9]];
-				scaleBuffer[10] = _interTable[(scaleBuffer[11] << 8) | scaleBuffer[9]];
-
-				scaleBuffer[13] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[15]];
-				scaleBuffer[12] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[13]];
-				scaleBuffer[14] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[13]];
-
-				scaleBlock(dst, scaleBuffer);
-				break;
-			}
-			case 0xFE:
-				// Copy a block using an absolute offset
-				copyBlock(dst, bufOffset, (int16)READ_LE_UINT16(src));
-				src += 2;
-				break;
-			case 0xFD: {
-				// Interpolate a 4x4 block based on 4 pixels, then scale to 8x8
-				byte scaleBuffer[16];
-				scaleBuffer[5] = src[0];
-				scaleBuffer[7] = src[1];
-				scaleBuffer[13] = src[2];
-				scaleBuffer[15] = src[3];
-
-				scaleBuffer[1] = _interTable[(dst[-_pitch + 3] << 8) | scaleBuffer[5]];
-				scaleBuffer[3] = _interTable[(dst[-_pitch + 7] << 8) | scaleBuffer[7]];
-				scaleBuffer[11] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[7]];
-				scaleBuffer[9] = _interTable[(scaleBuffer[13] << 8) | scaleBuffer[5]];
-
-				scaleBuffer[0] = _interTable[(dst[-1] << 8) | scaleBuffer[1]];
-				scaleBuffer[2] = _interTable[(scaleBuffer[3] << 8) | scaleBuffer[1]];
-				scaleBuffer[4] = _interTable[(dst[_pitch * 2 - 1] << 8) | scaleBuffer[5]];
-				scaleBuffer[6] = _interTable[(scaleBuffer[7] << 8) | scaleBuffer[5]];
-
-				scaleBuffer[8] = _interTable[(dst[_pitch * 3 - 1] << 8) | scaleBuffer[9]];
-				scaleBuffer[10] = _interTable[(scaleBuffer[11] << 8) | scaleBuffer[9]];
-				scaleBuffer[12] = _interTable[(dst[_pitch * 4 - 1] << 8) | scaleBuffer[13]];
-				scaleBuffer[14] = _interTable[(scaleBuffer[15] << 8) | scaleBuffer[13]];
-				
-				scaleBlock(dst, scaleBuffer);
-
-				src += 4;
-				break;
+			bool defer = false;
+
+			if (opcode == 0xFF || opcode == 0xFD) {
+				// These read the bottom row of the block above and the right
+				// column of the block to the left (which, for the first
+				// column, wraps around to the end of the previous row). At
+				// the top of a band the block above belongs to another band
+				// and isn't decoded yet.
+				if (!deferredAbove)
+					defer = (index != 0);
+				else if (deferredAbove[j] || (j == 0 && deferredAbove[_blockX - 1]))
+					defer = true;
+				else if (j != 0 && deferred[j - 1])
+					defer = true;
 			}
-			case 0xFC:
-				// Copy 4 4x4 blocks using the offset table
-				*((uint32 *)dst) = *((uint32 *)(dst + bufOffset + _offsetTable[src[0]]));
-				*((uint32 *)(dst + _pitch)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[0]] + _pitch));
-				*((uint32 *)(dst + _pitch * 2)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[0]] + _pitch * 2));
-				*((uint32 *)(dst + _pitch * 3)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[0]] + _pitch * 3));
-
-				*((uint32 *)(dst + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[1]] + 4));
-				*((uint32 *)(dst + _pitch + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[1]] + _pitch + 4));
-				*((uint32 *)(dst + _pitch * 2 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[1]] + _pitch * 2 + 4));
-				*((uint32 *)(dst + _pitch * 3 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[1]] + _pitch * 3 + 4));
-
-				*((uint32 *)(dst + _pitch * 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[2]] + _pitch * 4));
-				*((uint32 *)(dst + _pitch * 5)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[2]] + _pitch * 5));
-				*((uint32 *)(dst + _pitch * 6)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[2]] + _pitch * 6));
-				*((uint32 *)(dst + _pitch * 7)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[2]] + _pitch * 7));
-
-				*((uint32 *)(dst + _pitch * 4 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[3]] + _pitch * 4 + 4));
-				*((uint32 *)(dst + _pitch * 5 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[3]] + _pitch * 5 + 4));
-				*((uint32 *)(dst + _pitch * 6 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[3]] + _pitch * 6 + 4));
-				*((uint32 *)(dst + _pitch * 7 + 4)) = *((uint32 *)(dst + bufOffset + _offsetTable[src[3]] + _pitch * 7 + 4));
-
-				src += 4;
-				break;
-			case 0xFB:
-				// Copy 4 4x4 blocks using absolute offsets
-				*((uint32 *)dst) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src)));
-				*((uint32 *)(dst + _pitch)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src) + _pitch));
-				*((uint32 *)(dst + _pitch * 2)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src) + _pitch * 2));
-				*((uint32 *)(dst + _pitch * 3)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src) + _pitch * 3));
-
-				*((uint32 *)(dst + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + 4));
-				*((uint32 *)(dst + _pitch + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + _pitch + 4));
-				*((uint32 *)(dst + _pitch * 2 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + _pitch * 2 + 4));
-				*((uint32 *)(dst + _pitch * 3 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + _pitch * 3 + 4));
-
-				*((uint32 *)(dst + _pitch * 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + _pitch * 4));
-				*((uint32 *)(dst + _pitch * 5)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + _pitch * 5));
-				*((uint32 *)(dst + _pitch * 6)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + _pitch * 6));
-				*((uint32 *)(dst + _pitch * 7)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + _pitch * 7));
-
-				*((uint32 *)(dst + _pitch * 4 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + _pitch * 4 + 4));
-				*((uint32 *)(dst + _pitch * 5 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + _pitch * 5 + 4));
-				*((uint32 *)(dst + _pitch * 6 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + _pitch * 6 + 4));
-				*((uint32 *)(dst + _pitch * 7 + 4)) = *((uint32 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + _pitch * 7 + 4));
-				src += 8;
-				break;
-			case 0xFA:
-				// Scale a 4x4 block to an 8x8 block
-				scaleBlock(dst, src);
-				src += 16;
-				break;
-			case 0xF9:
-				// Copy 16 2x2 blocks using the offset table
-				*((uint16 *)dst) = *((uint16 *)(dst + bufOffset + _offsetTable[src[0]]));
-				*((uint16 *)(dst + _pitch)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[0]] + _pitch));
-
-				*((uint16 *)(dst + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[1]] + 2));
-				*((uint16 *)(dst + _pitch + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[1]] + _pitch + 2));
-
-				*((uint16 *)(dst + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[2]] + 4));
-				*((uint16 *)(dst + _pitch + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[2]] + _pitch + 4));
-
-				*((uint16 *)(dst + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[3]] + 6));
-				*((uint16 *)(dst + _pitch + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[3]] + _pitch + 6));
-
-				*((uint16 *)(dst + _pitch * 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[4]] + _pitch * 2));
-				*((uint16 *)(dst + _pitch * 3)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[4]] + _pitch * 3));
-
-				*((uint16 *)(dst + _pitch * 2 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[5]] + _pitch * 2 + 2));
-				*((uint16 *)(dst + _pitch * 3 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[5]] + _pitch * 3 + 2));
-
-				*((uint16 *)(dst + _pitch * 2 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[6]] + _pitch * 2 + 4));
-				*((uint16 *)(dst + _pitch * 3 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[6]] + _pitch * 3 + 4));
-
-				*((uint16 *)(dst + _pitch * 2 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[7]] + _pitch * 2 + 6));
-				*((uint16 *)(dst + _pitch * 3 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[7]] + _pitch * 3 + 6));
-
-				*((uint16 *)(dst + _pitch * 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[8]] + _pitch * 4));
-				*((uint16 *)(dst + _pitch * 5)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[8]] + _pitch * 5));
-
-				*((uint16 *)(dst + _pitch * 4 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[9]] + _pitch * 4 + 2));
-				*((uint16 *)(dst + _pitch * 5 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[9]] + _pitch * 5 + 2));
-
-				*((uint16 *)(dst + _pitch * 4 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[10]] + _pitch * 4 + 4));
-				*((uint16 *)(dst + _pitch * 5 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[10]] + _pitch * 5 + 4));
-
-				*((uint16 *)(dst + _pitch * 4 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[11]] + _pitch * 4 + 6));
-				*((uint16 *)(dst + _pitch * 5 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[11]] + _pitch * 5 + 6));
-
-				*((uint16 *)(dst + _pitch * 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[12]] + _pitch * 6));
-				*((uint16 *)(dst + _pitch * 7)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[12]] + _pitch * 7));
-
-				*((uint16 *)(dst + _pitch * 6 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[13]] + _pitch * 6 + 2));
-				*((uint16 *)(dst + _pitch * 7 + 2)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[13]] + _pitch * 7 + 2));
-
-				*((uint16 *)(dst + _pitch * 6 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[14]] + _pitch * 6 + 4));
-				*((uint16 *)(dst + _pitch * 7 + 4)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[14]] + _pitch * 7 + 4));
-
-				*((uint16 *)(dst + _pitch * 6 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[15]] + _pitch * 6 + 6));
-				*((uint16 *)(dst + _pitch * 7 + 6)) = *((uint16 *)(dst + bufOffset + _offsetTable[src[15]] + _pitch * 7 + 6));
-				src += 16;
-				break;
-			case 0xF8:
-				// Copy 16 2x2 blocks using absolute offsets
-				*((uint16 *)dst) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src)));
-				*((uint16 *)(dst + _pitch)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src) + _pitch));
-		
-				*((uint16 *)(dst + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + 2));
-				*((uint16 *)(dst + _pitch + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 2) + _pitch + 2));
-
-				*((uint16 *)(dst + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + 4));
-				*((uint16 *)(dst + _pitch + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 4) + _pitch + 4));
-
-				*((uint16 *)(dst + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + 6));
-				*((uint16 *)(dst + _pitch + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 6) + _pitch + 6));
-
-				*((uint16 *)(dst + _pitch * 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 8) + _pitch * 2));
-				*((uint16 *)(dst + _pitch * 3)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 8) + _pitch * 3));
-
-				*((uint16 *)(dst + _pitch * 2 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 10) + _pitch * 2 + 2));
-				*((uint16 *)(dst + _pitch * 3 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 10) + _pitch * 3 + 2));
-
-				*((uint16 *)(dst + _pitch * 2 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 12) + _pitch * 2 + 4));
-				*((uint16 *)(dst + _pitch * 3 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 12) + _pitch * 3 + 4));
-
-				*((uint16 *)(dst + _pitch * 2 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 14) + _pitch * 2 + 6));
-				*((uint16 *)(dst + _pitch * 3 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 14) + _pitch * 3 + 6));
-
-				*((uint16 *)(dst + _pitch * 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 16) + _pitch * 4));
-				*((uint16 *)(dst + _pitch * 5)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 16) + _pitch * 5));
-
-				*((uint16 *)(dst + _pitch * 4 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 18) + _pitch * 4 + 2));
-				*((uint16 *)(dst + _pitch * 5 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 18) + _pitch * 5 + 2));
-
-				*((uint16 *)(dst + _pitch * 4 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 20) + _pitch * 4 + 4));
-				*((uint16 *)(dst + _pitch * 5 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 20) + _pitch * 5 + 4));
-
-				*((uint16 *)(dst + _pitch * 4 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 22) + _pitch * 4 + 6));
-				*((uint16 *)(dst + _pitch * 5 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 22) + _pitch * 5 + 6));
-
-				*((uint16 *)(dst + _pitch * 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 24) + _pitch * 6));
-				*((uint16 *)(dst + _pitch * 7)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 24) + _pitch * 7));
-
-				*((uint16 *)(dst + _pitch * 6 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 26) + _pitch * 6 + 2));
-				*((uint16 *)(dst + _pitch * 7 + 2)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 26) + _pitch * 7 + 2));
-
-				*((uint16 *)(dst + _pitch * 6 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 28) + _pitch * 6 + 4));
-				*((uint16 *)(dst + _pitch * 7 + 4)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 28) + _pitch * 7 + 4));
-
-				*((uint16 *)(dst + _pitch * 6 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 30) + _pitch * 6 + 6));
-				*((uint16 *)(dst + _pitch * 7 + 6)) = *((uint16 *)(dst + bufOffset + (int16)READ_LE_UINT16(src + 30) + _pitch * 7 + 6));
-
-				src += 32;
-				break;
-			case 0xF7:
-				// Raw 8x8 block
-				*((uint32 *)dst) = *((uint32 *)src);
-				*((uint32 *)(dst + 4)) = *((uint32 *)(src + 4));
-				*((uint32 *)(dst + _pitch)) = *((uint32 *)(src + 8));
-				*((uint32 *)(dst + _pitch + 4)) = *((uint32 *)(src + 12));
-				*((uint32 *)(dst + _pitch * 2)) = *((uint32 *)(src + 16));
-				*((uint32 *)(dst + _pitch * 2 + 4)) = *((uint32 *)(src + 20));
-				*((uint32 *)(dst + _pitch * 3)) = *((uint32 *)(src + 24));
-				*((uint32 *)(dst + _pitch * 3 + 4)) = *((uint32 *)(src + 28));
-				*((uint32 *)(dst + _pitch * 4)) = *((uint32 *)(src + 32));
-				*((uint32 *)(dst + _pitch * 4 + 4)) = *((uint32 *)(src + 36));
-				*((uint32 *)(dst + _pitch * 5)) = *((uint32 *)(src + 40));
-				*((uint32 *)(dst + _pitch * 5 + 4)) = *((uint32 *)(src + 44));
-				*((uint32 *)(dst + _pitch * 6)) = *((uint32 *)(src + 48));
-				*((uint32 *)(dst + _pitch * 6 + 4)) = *((uint32 *)(src + 52));
-				*((uint32 *)(dst + _pitch * 7)) = *((uint32 *)(src + 56));
-				*((uint32 *)(dst + _pitch * 7 + 4)) = *((uint32 *)(src + 60));
-
-				src += 64;
-				break;
-			default:
-				// Copy a block using the offset table
-				copyBlock(dst, bufOffset, _offsetTable[opcode]);
-				break;
+
+			// The first block of a row also reads the old right column of the
+			// last block of the same row, so that one has to wait its turn
+			if (j != 0 && j == _blockX - 1 && deferred[0])
+				defer = true;
+
+			deferred[j] = defer;
+			dirty[j] = !(_flipped && copiesPrevious(src, opcode));
+
+			if (defer) {
+				DeferredBlock block;
+				block.dst = dst;
+				block.src = src;
+				block.opcode = opcode;
+				band.deferred.push_back(block);
+			} else {
+				decodeBlock(dst, src, opcode, bufOffset);
 			}
 
+			src += getPayloadSize(opcode);
 			dst += 8;
 		}
 
@@ -525,36 +834,33 @@ void Codec48Decoder::decode3(byte *dst, const byte *src, int bufOffset) {
 	}
 }
 
-void Codec48Decoder::copyBlock(byte *dst, int deltaBufOffset, int offset) {
-	const byte *src = dst + deltaBufOffset + offset;
+void Codec48Decoder::decode3(byte *dst, const byte *src, int bufOffset) {
+	_bandDst = dst;
+	_bandOffset = bufOffset;
 
-	for (int i = 0; i < 8; i++) {
-		*((uint32 *)(dst + _pitch * i)) = *((uint32 *)(src + _pitch * i));
-		*((uint32 *)(dst + _pitch * i + 4)) = *((uint32 *)(src + _pitch * i + 4));
+	// Pre-scan the opcodes to find where each band starts in the stream
+	for (int i = 0, row = 0; i < _bandCount; i++) {
+		for (; row < _bands[i].firstRow; row++)
+			for (int j = 0; j < _blockX; j++)
+				src += getPayloadSize(*src) + 1;
+
+		_bands[i].src = src;
 	}
-}
 
-void Codec48Decoder::scaleBlock(byte *dst, const byte *src) {
-	// This is doing a 2x scale of data
+	if (_bandCount == 1) {
+		decodeBand(0);
+		return;
+	}
 
-	for (int i = 0; i < 4; i++) {
-		uint16 pixels = src[0];
-		pixels = (pixels << 8) | pixels;
-		*((uint16 *)dst) = pixels;
-		*((uint16 *)(dst + _pitch)) = pixels;
-		pixels = src[1];
-		pixels = (pixels << 8) | pixels;
-		*((uint16 *)(dst + 2)) = pixels;
-		*((uint16 *)(dst + _pitch + 2)) = pixels;
-		pixels = src[2];
-		pixels = (pixels << 8) | pixels;
-		*((uint16 *)(dst + 4)) = pixels;
-		*((uint16 *)(dst + _pitch + 4)) = pixels;
-		pixels = src[3];
-		pixels = (pixels << 8) | pixels;
-		*((uint16 *)(dst + 6)) = pixels;
-		*((uint16 *)(dst + _pitch + 6)) = pixels;
-		src += 4;
-		dst += _pitch * 2;
+	// The copy opcodes only read the previous frame, so the bands are
+	// independent apart from the 0xFF/0xFD blocks decodeBand() defers
+	_pool->run(decodeBandJob, this, _bandCount);
+
+	// Now finish the blocks that depended on another band, in stream order
+	for (int i = 0; i < _bandCount; i++) {
+		const std::vector<DeferredBlock> &deferred = _bands[i].deferred;
+
+		for (uint j = 0; j < deferred.size(); j++)
+			decodeBlock(deferred[j].dst, deferred[j].src, deferred[j].opcode, bufOffset);
 	}
 }
@@ -23,22 +23,128 @@
 #ifndef CODEC48_H
 #define CODEC48_H
 
+#include <vector>
+#include "cpu.h"
 #include "types.h"
 
+/**
+ * The per-block copy/fill operations of decode3(). Every implementation
+ * writes exactly the same bytes as the scalar one; only the instruction
+ * set differs.
+ */
+struct Codec48Kernels {
+	/** Copy an 8x8 block */
+	void (*copyBlock)(byte *dst, const byte *src, int pitch);
+
+	/** Scale a 4x4 block (16 packed bytes) up to an 8x8 block */
+	void (*scaleBlock)(byte *dst, const byte *src, int pitch);
+
+	/** Copy four 4x4 blocks, each from src + offsets[i] */
+	void (*copyQuads)(byte *dst, const byte *src, const int *offsets, int pitch);
+
+	/** Copy sixteen 2x2 blocks, each from src + offsets[i] */
+	void (*copyPairs)(byte *dst, const byte *src, const int *offsets, int pitch);
+
+	/** Copy a raw 8x8 block (64 packed bytes) */
+	void (*rawBlock)(byte *dst, const byte *src, int pitch);
+};
+
+/** Select the decode3() kernels for the given tier. */
+void bindCodec48Kernels(CPUTier tier);
+
+class WorkerPool;
+
 class Codec48Decoder {
 public:
 	Codec48Decoder(int width, int height);
 	~Codec48Decoder();
-	bool decode(byte *dst, const byte *src);
+
+	/**
+	 * Decode a frame into the decoder's own buffers. The result is read
+	 * through getOutput() rather than copied out.
+	 */
+	bool decode(const byte *src);
+
+	/**
+	 * The most recently decoded frame (_width x _height at getPitch()).
+	 * Only valid until the next call to decode().
+	 */
+	const byte *getOutput() const { return _deltaBuf[_curBuf]; }
+	int getPitch() const { return _pitch; }
+
+	/**
+	 * One byte per 8x8 block, row by row, nonzero where the last decode()
+	 * changed the output compared to the frame before it.
+	 */
+	const byte *getDirtyBlocks() const { return _dirty; }
+
+	/**
+	 * Set how many threads decode3() frames are split across, in bands of
+	 * block rows. 0 picks one per processor; 1 decodes serially. Frames
+	 * too short to split that many ways use fewer bands.
+	 */
+	void setThreadCount(int threadCount);
+
+	/**
+	 * Everything decode() carries from one frame to the next. Restoring a
+	 * saved state lets decoding resume at the frame after the one it was
+	 * saved at.
+	 */
+	class State {
+	public:
+		State() : _deltaBuf(0), _interTable(0), _curBuf(0), _prevSeqNb(0) {}
+		~State() { delete[] _deltaBuf; delete[] _interTable; }
+
+	private:
+		friend class Codec48Decoder;
+
+		// Prevent copying instances by accident
+		State(const State &);
+		State &operator=(const State &);
+
+		byte *_deltaBuf;
+		byte *_interTable;
+		int _curBuf;
+		int16 _prevSeqNb;
+	};
+
+	/** Bytes a State saved from this decoder takes up */
+	uint32 getStateSize() const;
+
+	void saveState(State &state) const;
+
+	/** The next getDirtyBlocks() marks the whole frame. */
+	void restoreState(const State &state);
 
 private:
+	enum {
+		/** The fewest block rows worth handing to a thread of their own */
+		kMinBandRows = 16
+	};
+
+	/** A block whose neighbours are decoded by another band */
+	struct DeferredBlock {
+		byte *dst;
+		const byte *src;
+		byte opcode;
+	};
+
+	/** A run of block rows decoded by one thread */
+	struct Band {
+		int firstRow, lastRow;
+		const byte *src;
+		std::vector<DeferredBlock> deferred;
+	};
+
 	void makeTable(int pitch, int index);
 
 	void bompDecodeLine(byte *dst, const byte *src, int len);
 
 	void decode3(byte *dst, const byte *src, int bufOffset);
-	void scaleBlock(byte *dst, const byte *src);
-	void copyBlock(byte *dst, int deltaBufOffset, int offset);
+	void decodeBand(int index);
+	void decodeBlock(byte *dst, const byte *src, byte opcode, int bufOffset);
+	bool copiesPrevious(const byte *src, byte opcode) const;
+	static void decodeBandJob(void *param, int index);
 
 	int _curBuf;
 	byte *_deltaBuf[2];
@@ -50,6 +156,16 @@ private:
 	int32 _frameSize;
 	int _width, _height;
 	byte *_interTable;
+
+	WorkerPool *_pool;
+	std::vector<Band> _bands;
+	int _bandCount;
+	byte *_deferred;
+	byte *_bandDst;
+	int _bandOffset;
+
+	byte *_dirty;
+	bool _flipped;
 };
 
 #endif
@@ -0,0 +1,154 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "codec48.h"
+#include "cpu.h"
+#include "graphicsman.h"
+#include "pcm.h"
+#include "rate.h"
+#include "simd.h"
+#include "util.h"
+
+#if defined(SMUSH_SIMD_SSE2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static CPUTier s_tier = kCPUTierScalar;
+
+static const char *const s_tierNames[] = {
+	"scalar",
+	"sse2",
+	"ssse3",
+	"avx2",
+	"avx512",
+	"neon"
+};
+
+CPUTier detectCPUTier() {
+#if defined(SMUSH_SIMD_SSE2) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	if (!(info[3] & (1 << 26)))
+		return kCPUTierScalar;
+
+	if (!(info[2] & (1 << 9)))
+		return kCPUTierSSE2;
+
+	// AVX state has to be enabled by the OS as well (OSXSAVE + XCR0)
+	bool osAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x6) == 0x6;
+	if (!osAVX || maxLeaf < 7)
+		return kCPUTierSSSE3;
+
+	__cpuidex(info, 7, 0);
+	if (!(info[1] & (1 << 5)))
+		return kCPUTierSSSE3;
+
+	if ((info[1] & (1 << 16)) && (_xgetbv(0) & 0xE6) == 0xE6)
+		return kCPUTierAVX512;
+
+	return kCPUTierAVX2;
+#elif defined(SMUSH_SIMD_SSE2)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return kCPUTierAVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return kCPUTierAVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return kCPUTierSSSE3;
+	if (__builtin_cpu_supports("sse2"))
+		return kCPUTierSSE2;
+
+	return kCPUTierScalar;
+#elif defined(SMUSH_SIMD_NEON)
+	return kCPUTierNEON;
+#else
+	return kCPUTierScalar;
+#endif
+}
+
+static CPUTier clampTier(CPUTier tier, CPUTier detected) {
+	if (tier <= kCPUTierScalar || tier > kCPUTierNEON)
+		return MIN(MAX(tier, kCPUTierScalar), detected);
+
+	// NEON and the x86 tiers don't mix
+	if (detected == kCPUTierNEON || tier == kCPUTierNEON)
+		return detected;
+
+	return MIN(tier, detected);
+}
+
+CPUTier bindKernels(CPUTier tier) {
+	s_tier = clampTier(tier, detectCPUTier());
+
+	bindCodec48Kernels(s_tier);
+	bindGraphicsKernels(s_tier);
+	bindMixKernels(s_tier);
+	bindPCMKernels(s_tier);
+
+	return s_tier;
+}
+
+CPUTier getKernelTier() {
+	return s_tier;
+}
+
+const char *getCPUTierName(CPUTier tier) {
+	if (tier < 0 || tier >= ARRAYSIZE(s_tierNames))
+		return "unknown";
+
+	return s_tierNames[tier];
+}
+
+void initKernels() {
+	CPUTier tier = detectCPUTier();
+	const char *forced = getenv("SMUSH_CPU_TIER");
+
+	if (forced) {
+		bool found = false;
+
+		for (int i = 0; i < ARRAYSIZE(s_tierNames) && !found; i++) {
+			const char *a = forced, *b = s_tierNames[i];
+
+			while (*a && tolower(*a) == *b) {
+				a++;
+				b++;
+			}
+
+			if (!*a && !*b) {
+				tier = (CPUTier)i;
+				found = true;
+			}
+		}
+
+		if (!found)
+			fprintf(stderr, "Unknown SMUSH_CPU_TIER '%s'\n", forced);
+	}
+
+	bindKernels(tier);
+}
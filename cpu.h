@@ -0,0 +1,64 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+/**
+ * Instruction set tiers the pixel and audio kernels are built for. A tier
+ * implies every tier below it on the same architecture.
+ */
+enum CPUTier {
+	kCPUTierScalar = 0,
+	kCPUTierSSE2 = 1,
+	kCPUTierSSSE3 = 2,
+	kCPUTierAVX2 = 3,
+	kCPUTierAVX512 = 4,
+	kCPUTierNEON = 5
+};
+
+/** Return the best tier the running CPU (and OS) supports. */
+CPUTier detectCPUTier();
+
+/**
+ * Bind every kernel family to the implementation for the given tier.
+ * Tiers the CPU does not support are lowered to the detected tier.
+ *
+ * @return the tier that was actually bound
+ */
+CPUTier bindKernels(CPUTier tier);
+
+/** Return the currently bound tier. */
+CPUTier getKernelTier();
+
+/**
+ * Detect the CPU and bind the kernels. The SMUSH_CPU_TIER environment
+ * variable (scalar, sse2, ssse3, avx2, avx512 or neon) forces a lower tier
+ * for benchmarking and output verification.
+ */
+void initKernels();
+
+const char *getCPUTierName(CPUTier tier);
+
+#endif
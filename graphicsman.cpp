@@ -21,33 +21,429 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "graphicsman.h"
+#include "simd.h"
+#include "util.h"
 
-// TODO: aspect ratio correction option
-// TODO: resize/scaling option
+struct GraphicsKernels {
+	/** Expand a row of 8bpp indices to packed 24-bit pixels through the palette LUT */
+	void (*expandRow)(byte *dst, const byte *src, const uint32 *lut, uint width);
+
+	/** Expand a row of 8bpp indices to 32-bit pixels through the palette LUT */
+	void (*expandRow32)(byte *dst, const byte *src, const uint32 *lut, uint width);
+
+	/** Expand a row of 8bpp indices to RGB565 pixels through the palette LUT */
+	void (*expandRow16)(byte *dst, const byte *src, const uint32 *lut, uint width);
+
+	/** Pick src[xindex[x]] for each output index; srcWidth bounds the reads */
+	void (*scaleRowNearest)(byte *dst, const byte *src, const uint32 *xindex, uint width, uint srcWidth);
+
+	/**
+	 * Blend BGRA pixels from two source rows. Each output pixel mixes
+	 * columns xindex[x] and xindex[x] + 1 by xweight[x] (0-256), then the
+	 * two rows by yweight.
+	 */
+	void (*scaleRowBilinear)(byte *dst, const byte *row0, const byte *row1, const uint32 *lut,
+		const uint32 *xindex, const uint32 *xweight, uint yweight, uint width, uint srcWidth);
+
+	/** Pack BGRA words down to 24-bit pixels */
+	void (*packRow24)(byte *dst, const uint32 *src, uint width);
+
+	/** Pack BGRA words down to RGB565 pixels */
+	void (*packRow16)(byte *dst, const uint32 *src, uint width);
+
+	/**
+	 * Average each 2x2 block of bpp-byte pixels from two rows into one.
+	 * step is the distance to the right-hand pixel, 0 for a one-pixel row.
+	 */
+	void (*downsampleRow)(byte *dst, const byte *row0, const byte *row1, uint width, uint bpp, uint step);
+};
+
+// The LUT holds each colour as B, G, R, 255 in memory, so a 24-bit pixel
+// can be written with one 4-byte store. The next pixel rewrites the extra
+// byte; only the last one in the row is written 3 bytes wide.
+
+static void expandRowScalar(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	if (width == 0)
+		return;
+
+	for (uint x = 0; x + 1 < width; x++) {
+		memcpy(dst, &lut[src[x]], 4);
+		dst += 3;
+	}
+
+	uint32 last = lut[src[width - 1]];
+	dst[0] = (byte)last;
+	dst[1] = (byte)(last >> 8);
+	dst[2] = (byte)(last >> 16);
+}
+
+static void expandRow32Scalar(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	for (uint x = 0; x < width; x++)
+		memcpy(dst + x * 4, &lut[src[x]], 4);
+}
+
+static inline uint16 packRGB565(uint32 bgra) {
+	return (uint16)(((bgra >> 8) & 0xF800) | ((bgra >> 5) & 0x07E0) | ((bgra >> 3) & 0x001F));
+}
+
+static void expandRow16Scalar(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	for (uint x = 0; x < width; x++) {
+		uint16 pixel = packRGB565(lut[src[x]]);
+		memcpy(dst + x * 2, &pixel, 2);
+	}
+}
+
+static void scaleRowNearestScalar(byte *dst, const byte *src, const uint32 *xindex, uint width, uint /*srcWidth*/) {
+	for (uint x = 0; x < width; x++)
+		dst[x] = src[xindex[x]];
+}
+
+// Blue/red and green/alpha are blended as two pairs of 16-bit lanes. A
+// weight of at most 256 keeps every lane below 65536.
+static inline uint32 lerpBGRA(uint32 a, uint32 b, uint32 weight) {
+	uint32 inverse = 256 - weight;
+	uint32 rb = (((a & 0x00FF00FF) * inverse + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+	uint32 ga = (((a >> 8) & 0x00FF00FF) * inverse + ((b >> 8) & 0x00FF00FF) * weight) & 0xFF00FF00;
+	return rb | ga;
+}
+
+static void scaleRowBilinearScalar(byte *dst, const byte *row0, const byte *row1, const uint32 *lut,
+		const uint32 *xindex, const uint32 *xweight, uint yweight, uint width, uint /*srcWidth*/) {
+	for (uint x = 0; x < width; x++) {
+		uint32 sx = xindex[x];
+		uint32 top = lerpBGRA(lut[row0[sx]], lut[row0[sx + 1]], xweight[x]);
+		uint32 bottom = lerpBGRA(lut[row1[sx]], lut[row1[sx + 1]], xweight[x]);
+		uint32 pixel = lerpBGRA(top, bottom, yweight);
+		memcpy(dst + x * 4, &pixel, 4);
+	}
+}
+
+static void packRow24Scalar(byte *dst, const uint32 *src, uint width) {
+	for (uint x = 0; x < width; x++) {
+		dst[x * 3] = (byte)src[x];
+		dst[x * 3 + 1] = (byte)(src[x] >> 8);
+		dst[x * 3 + 2] = (byte)(src[x] >> 16);
+	}
+}
+
+static void packRow16Scalar(byte *dst, const uint32 *src, uint width) {
+	for (uint x = 0; x < width; x++) {
+		uint16 pixel = packRGB565(src[x]);
+		memcpy(dst + x * 2, &pixel, 2);
+	}
+}
+
+static void downsampleRowScalar(byte *dst, const byte *row0, const byte *row1, uint width, uint bpp, uint step) {
+	for (uint x = 0; x < width; x++) {
+		const byte *a = row0 + x * 2 * bpp;
+		const byte *b = row1 + x * 2 * bpp;
+
+		for (uint c = 0; c < bpp; c++)
+			dst[x * bpp + c] = (byte)((a[c] + a[c + step] + b[c] + b[c + step] + 2) >> 2);
+	}
+}
+
+static const GraphicsKernels s_scalarKernels = {
+	expandRowScalar,
+	expandRow32Scalar,
+	expandRow16Scalar,
+	scaleRowNearestScalar,
+	scaleRowBilinearScalar,
+	packRow24Scalar,
+	packRow16Scalar,
+	downsampleRowScalar
+};
+
+#ifdef SMUSH_SIMD_SSE2
+
+// SSSE3 packs four LUT entries down to 12 bytes per shuffle. Each store
+// also writes 4 bytes past them, which the following iteration (or the
+// tail) rewrites, so stop while six whole pixels are still left in the row.
+
+SMUSH_TARGET_SSSE3 static void expandRowSSSE3(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	uint x = 0;
+
+	for (; x + 6 <= width; x += 4) {
+		__m128i pixels = _mm_setr_epi32(lut[src[x]], lut[src[x + 1]], lut[src[x + 2]], lut[src[x + 3]]);
+		_mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi8(pixels, pack));
+	}
+
+	expandRowScalar(dst + x * 3, src + x, lut, width - x);
+}
+
+// Same overlapping stores as expandRowSSSE3
+SMUSH_TARGET_SSSE3 static void packRow24SSSE3(byte *dst, const uint32 *src, uint width) {
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	uint x = 0;
+
+	for (; x + 6 <= width; x += 4)
+		_mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + x)), pack));
+
+	packRow24Scalar(dst + x * 3, src + x, width - x);
+}
+
+static const GraphicsKernels s_ssse3Kernels = {
+	expandRowSSSE3,
+	expandRow32Scalar,
+	expandRow16Scalar,
+	scaleRowNearestScalar,
+	scaleRowBilinearScalar,
+	packRow24SSSE3,
+	packRow16Scalar,
+	downsampleRowScalar
+};
+
+#endif
+
+#ifdef SMUSH_SIMD_AVX2
+
+SMUSH_TARGET_AVX2 static void expandRowAVX2(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	const __m256i pack = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	uint x = 0;
+
+	// Eight pixels per gather, stored as two overlapping 12-byte halves
+	for (; x + 10 <= width; x += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+		__m256i pixels = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *)lut, indices, 4), pack);
+
+		_mm_storeu_si128((__m128i *)(dst + x * 3), _mm256_castsi256_si128(pixels));
+		_mm_storeu_si128((__m128i *)(dst + x * 3 + 12), _mm256_extracti128_si256(pixels, 1));
+	}
+
+	expandRowSSSE3(dst + x * 3, src + x, lut, width - x);
+}
+
+SMUSH_TARGET_AVX2 static void expandRow32AVX2(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	uint x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_i32gather_epi32((const int *)lut, indices, 4));
+	}
+
+	expandRow32Scalar(dst + x * 4, src + x, lut, width - x);
+}
+
+SMUSH_TARGET_AVX2 static inline __m256i packRGB565AVX2(__m256i bgra) {
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(bgra, 8), _mm256_set1_epi32(0xF800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(bgra, 5), _mm256_set1_epi32(0x07E0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(bgra, 3), _mm256_set1_epi32(0x001F));
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+SMUSH_TARGET_AVX2 static void expandRow16AVX2(byte *dst, const byte *src, const uint32 *lut, uint width) {
+	uint x = 0;
+
+	// Sixteen pixels per iteration; packus interleaves the lanes, so put
+	// the quarters back in order before storing
+	for (; x + 16 <= width; x += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(src + x));
+		__m256i lo = _mm256_i32gather_epi32((const int *)lut, _mm256_cvtepu8_epi32(bytes), 4);
+		__m256i hi = _mm256_i32gather_epi32((const int *)lut, _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), 4);
+		__m256i packed = _mm256_packus_epi32(packRGB565AVX2(lo), packRGB565AVX2(hi));
+
+		_mm256_storeu_si256((__m256i *)(dst + x * 2), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+
+	expandRow16Scalar(dst + x * 2, src + x, lut, width - x);
+}
+
+// The scalers gather four source bytes per pixel with one dword gather,
+// so they only run while the last column read stays inside the row.
+
+SMUSH_TARGET_AVX2 static void scaleRowNearestAVX2(byte *dst, const byte *src, const uint32 *xindex, uint width, uint srcWidth) {
+	uint x = 0;
+
+	for (; x + 8 <= width && xindex[x + 7] + 4 <= srcWidth; x += 8) {
+		__m256i indices = _mm256_loadu_si256((const __m256i *)(xindex + x));
+		__m256i pixels = _mm256_and_si256(_mm256_i32gather_epi32((const int *)src, indices, 1), _mm256_set1_epi32(0xFF));
+
+		pixels = _mm256_packus_epi32(pixels, pixels);
+		pixels = _mm256_packus_epi16(pixels, pixels);
+		_mm_storel_epi64((__m128i *)(dst + x), _mm_unpacklo_epi32(_mm256_castsi256_si128(pixels), _mm256_extracti128_si256(pixels, 1)));
+	}
+
+	scaleRowNearestScalar(dst + x, src, xindex + x, width - x, srcWidth);
+}
+
+SMUSH_TARGET_AVX2 static inline __m256i lerpBGRAAVX2(__m256i a, __m256i b, __m256i weight, __m256i inverse) {
+	const __m256i low = _mm256_set1_epi32(0x00FF00FF);
+	__m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(a, low), inverse), _mm256_mullo_epi16(_mm256_and_si256(b, low), weight));
+	__m256i ga = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(a, 8), inverse), _mm256_mullo_epi16(_mm256_srli_epi16(b, 8), weight));
+	return _mm256_or_si256(_mm256_srli_epi16(rb, 8), _mm256_andnot_si256(low, ga));
+}
+
+SMUSH_TARGET_AVX2 static void scaleRowBilinearAVX2(byte *dst, const byte *row0, const byte *row1, const uint32 *lut,
+		const uint32 *xindex, const uint32 *xweight, uint yweight, uint width, uint srcWidth) {
+	const __m256i byteMask = _mm256_set1_epi32(0xFF);
+	const __m256i full = _mm256_set1_epi16(256);
+	const __m256i wy = _mm256_set1_epi16((short)yweight);
+	const __m256i iwy = _mm256_sub_epi16(full, wy);
+	uint x = 0;
+
+	for (; x + 8 <= width && xindex[x + 7] + 4 <= srcWidth; x += 8) {
+		__m256i indices = _mm256_loadu_si256((const __m256i *)(xindex + x));
+		__m256i weights = _mm256_loadu_si256((const __m256i *)(xweight + x));
+		__m256i wx = _mm256_or_si256(weights, _mm256_slli_epi32(weights, 16));
+		__m256i iwx = _mm256_sub_epi16(full, wx);
+
+		// Each gather brings in both neighbouring columns
+		__m256i top = _mm256_i32gather_epi32((const int *)row0, indices, 1);
+		__m256i bottom = _mm256_i32gather_epi32((const int *)row1, indices, 1);
+
+		__m256i top0 = _mm256_i32gather_epi32((const int *)lut, _mm256_and_si256(top, byteMask), 4);
+		__m256i top1 = _mm256_i32gather_epi32((const int *)lut, _mm256_and_si256(_mm256_srli_epi32(top, 8), byteMask), 4);
+		__m256i bottom0 = _mm256_i32gather_epi32((const int *)lut, _mm256_and_si256(bottom, byteMask), 4);
+		__m256i bottom1 = _mm256_i32gather_epi32((const int *)lut, _mm256_and_si256(_mm256_srli_epi32(bottom, 8), byteMask), 4);
+
+		__m256i pixels = lerpBGRAAVX2(lerpBGRAAVX2(top0, top1, wx, iwx), lerpBGRAAVX2(bottom0, bottom1, wx, iwx), wy, iwy);
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), pixels);
+	}
+
+	scaleRowBilinearScalar(dst + x * 4, row0, row1, lut, xindex + x, xweight + x, yweight, width - x, srcWidth);
+}
+
+SMUSH_TARGET_AVX2 static void packRow16AVX2(byte *dst, const uint32 *src, uint width) {
+	uint x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i lo = packRGB565AVX2(_mm256_loadu_si256((const __m256i *)(src + x)));
+		__m256i hi = packRGB565AVX2(_mm256_loadu_si256((const __m256i *)(src + x + 8)));
+
+		_mm256_storeu_si256((__m256i *)(dst + x * 2), _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8));
+	}
+
+	packRow16Scalar(dst + x * 2, src + x, width - x);
+}
+
+SMUSH_TARGET_AVX2 static void downsampleRowAVX2(byte *dst, const byte *row0, const byte *row1, uint width, uint bpp, uint step) {
+	uint x = 0;
+
+	// Eight 32-bit pixels from each row make four. The channels are summed
+	// in 16 bits: the two rows first, then each pixel with its neighbour in
+	// the other half of its 64-bit group.
+	if (bpp == 4 && step == 4) {
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i round = _mm256_set1_epi16(2);
+
+		for (; x + 4 <= width; x += 4) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)(row0 + x * 8));
+			__m256i b = _mm256_loadu_si256((const __m256i *)(row1 + x * 8));
+
+			__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+			__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+			lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+			hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+
+			__m256i sum = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), round), 2);
+			sum = _mm256_packus_epi16(sum, sum);
+			_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_unpacklo_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+		}
+	}
+
+	downsampleRowScalar(dst + x * bpp, row0 + x * 2 * bpp, row1 + x * 2 * bpp, width - x, bpp, step);
+}
+
+static const GraphicsKernels s_avx2Kernels = {
+	expandRowAVX2,
+	expandRow32AVX2,
+	expandRow16AVX2,
+	scaleRowNearestAVX2,
+	scaleRowBilinearAVX2,
+	packRow24SSSE3,
+	packRow16AVX2,
+	downsampleRowAVX2
+};
+
+#endif
+
+static const GraphicsKernels *s_kernels = &s_scalarKernels;
+
+void bindGraphicsKernels(CPUTier tier) {
+	switch (tier) {
+#ifdef SMUSH_SIMD_SSE2
+	case kCPUTierSSSE3:
+		s_kernels = &s_ssse3Kernels;
+		break;
+#endif
+#ifdef SMUSH_SIMD_AVX2
+	case kCPUTierAVX512:
+	case kCPUTierAVX2:
+		s_kernels = &s_avx2Kernels;
+		break;
+#endif
+	default:
+		s_kernels = &s_scalarKernels;
+	}
+}
 
 GraphicsManager::GraphicsManager() {
 	palette = new byte[768];
 	memset(palette, 0, 768);
+	for (int i = 0; i < 256; i++)
+		palettelut[i] = 0xFF000000;
+	newpalette = false;
+	format = kPixelFormatBGR24;
+
+	source = 0;
+	sourcepitch = 0;
+	surface = 0;
+	dirty = 0;
+	anydirty = false;
+
+	scalefilter = kScaleNone;
+	xnearest = 0;
+	xindex = 0;
+	xweight = 0;
+	barsdirty = false;
 }
 
 GraphicsManager::~GraphicsManager() {
-	delete[] bmp;
+	delete[] xnearest;
+	delete[] xindex;
+	delete[] xweight;
+	delete[] dirty;
+	delete[] surface;
 	delete[] palette;
 }
 
 bool GraphicsManager::init(uint width, uint height, bool isHighColor) {
 	bmpwidth = width;
 	bmpheight = height;
-	bmp = new byte[width*height*3];
+	outwidth = picwidth = width;
+	outheight = picheight = height;
+	picx = picy = 0;
+
+	dirtywidth = (width + 7) / 8;
+	dirtyheight = (height + 7) / 8;
+	dirty = new byte[dirtywidth*dirtyheight];
+	markDirty(0, 0, dirtywidth*dirtyheight);
 
 	return true;
 }
 
 void GraphicsManager::setPalette(const byte *ptr, uint start, uint count) {
+	if (memcmp(palette+start*3, ptr+start*3, count*3) != 0) {
+		newpalette = true;
+
+		// Every pixel has to be converted again after a new palette,
+		// unless the host looks the indices up itself
+		if (dirty && format != kPixelFormatIndexed8)
+			markDirty(0, 0, dirtywidth*dirtyheight);
+	}
+
 	memcpy(palette+start*3, ptr+start*3, count*3);
 
+	// Stored the way round toBitmap() writes them
+	for (uint i = start; i < start + count; i++)
+		palettelut[i] = palette[i*3+2] | (palette[i*3+1] << 8) | (palette[i*3] << 16) | 0xFF000000;
+
 	/*if (_workingScreen->format->BitsPerPixel != 8 || count == 0 || !ptr || start + count > 256)
 		return;
 
@@ -63,46 +459,672 @@ void GraphicsManager::setPalette(const byte *ptr, uint start, uint count) {
 	delete[] colors;*/
 }
 
-void GraphicsManager::toBitmap(void* scan0, int stride)
+void GraphicsManager::setPixelFormat(PixelFormat newFormat)
 {
-	for(int y=0; y<bmpheight; y++)
+	if(newFormat < kPixelFormatBGR24 || newFormat > kPixelFormatIndexed8 || newFormat == format)
+		return;
+
+	format = newFormat;
+
+	// Nothing the host holds is in the new format
+	if(dirty)
+		markDirty(0, 0, dirtywidth*dirtyheight);
+	barsdirty = true;
+}
+
+// Where output pixel o samples from, in 1/256ths of a source pixel, with
+// both the source and output pixel centres lined up. The right/bottom
+// neighbour always exists: the last column is reached with full weight on
+// it rather than past it.
+static void getBilinearTap(int o, int srcSize, int dstSize, uint32 &index, uint32 &weight)
+{
+	int64 pos = ((int64)(2*o+1) * srcSize * 256) / (2*dstSize) - 128;
+	pos = CLIP<int64>(pos, 0, (int64)(srcSize-1) * 256);
+
+	index = (uint32)(pos >> 8);
+	weight = (uint32)(pos & 255);
+
+	if(index >= (uint32)srcSize-1)
+	{
+		index = srcSize-2;
+		weight = 256;
+	}
+}
+
+static inline int getNearestTap(int o, int srcSize, int dstSize)
+{
+	return (int)(((int64)(2*o+1) * srcSize) / (2*dstSize));
+}
+
+void GraphicsManager::setScaling(ScaleFilter filter, bool aspect, int width, int height)
+{
+	delete[] xnearest;
+	delete[] xindex;
+	delete[] xweight;
+	xnearest = 0;
+	xindex = 0;
+	xweight = 0;
+
+	if(filter < kScaleNone || filter > kScaleBilinear)
+		filter = kScaleNone;
+
+	if(filter != kScaleNone && (width <= 0 || height <= 0))
+	{
+		// The frame's own width, at 4:3 if asked
+		width = bmpwidth;
+		height = aspect ? bmpwidth*3/4 : bmpheight;
+	}
+
+	if(filter == kScaleNone)
+	{
+		width = bmpwidth;
+		height = bmpheight;
+		aspect = false;
+	}
+
+	outwidth = CLIP(width, 1, bmpwidth*8);
+	outheight = CLIP(height, 1, bmpheight*8);
+
+	// Fit a 4:3 picture inside the output and leave black bars round it
+	if(aspect && outwidth*3 > outheight*4)
+	{
+		picheight = outheight;
+		picwidth = MAX(outheight*4/3, 1);
+	}
+	else if(aspect)
+	{
+		picwidth = outwidth;
+		picheight = MAX(outwidth*3/4, 1);
+	}
+	else
 	{
-		byte* srcRow = bmp + y*bmpwidth*3;
-		byte* dstRow = (byte*)scan0 + y*stride;
+		picwidth = outwidth;
+		picheight = outheight;
+	}
+
+	picx = (outwidth - picwidth) / 2;
+	picy = (outheight - picheight) / 2;
+
+	// Blending needs a neighbour on every axis
+	if(filter == kScaleBilinear && (bmpwidth < 2 || bmpheight < 2))
+		filter = kScaleNearest;
+
+	if(picwidth == bmpwidth && picheight == bmpheight && outwidth == bmpwidth && outheight == bmpheight)
+		filter = kScaleNone;
+
+	scalefilter = filter;
 
-		for(int x=0; x<bmpwidth; x++)
+	if(dirty)
+		markDirty(0, 0, dirtywidth*dirtyheight);
+	barsdirty = true;
+
+	if(scalefilter == kScaleNone)
+		return;
+
+	// Indexed output can't be blended, so bilinear keeps nearest taps too
+	xnearest = new uint32[picwidth];
+	for(int x=0; x<picwidth; x++)
+		xnearest[x] = getNearestTap(x, bmpwidth, picwidth);
+
+	if(scalefilter == kScaleBilinear)
+	{
+		xindex = new uint32[picwidth];
+		xweight = new uint32[picwidth];
+		for(int x=0; x<picwidth; x++)
+			getBilinearTap(x, bmpwidth, picwidth, xindex[x], xweight[x]);
+	}
+}
+
+int GraphicsManager::getBytesPerPixel() const
+{
+	switch(format)
+	{
+	case kPixelFormatBGRA32:
+		return 4;
+	case kPixelFormatRGB565:
+		return 2;
+	case kPixelFormatIndexed8:
+		return 1;
+	default:
+		return 3;
+	}
+}
+
+bool GraphicsManager::getPalette(byte *dst)
+{
+	memcpy(dst, palette, 768);
+
+	bool changed = newpalette;
+	newpalette = false;
+	return changed;
+}
+
+void GraphicsManager::convertRow(const GraphicsKernels *kernels, byte *dst, const byte *src, uint width) const
+{
+	switch(format)
+	{
+	case kPixelFormatBGRA32:
+		kernels->expandRow32(dst, src, palettelut, width);
+		break;
+	case kPixelFormatRGB565:
+		kernels->expandRow16(dst, src, palettelut, width);
+		break;
+	case kPixelFormatIndexed8:
+		memcpy(dst, src, width);
+		break;
+	default:
+		kernels->expandRow(dst, src, palettelut, width);
+	}
+}
+
+void GraphicsManager::fillBlack(byte *dst, int width) const
+{
+	if(format != kPixelFormatBGRA32)
+	{
+		memset(dst, 0, width*getBytesPerPixel());
+		return;
+	}
+
+	const uint32 black = 0xFF000000;
+	for(int x=0; x<width; x++)
+		memcpy(dst + x*4, &black, 4);
+}
+
+// Which output columns (or rows) can change when source ones in
+// [first, last) do. Kept loose by a pixel either way, which covers the
+// neighbour a bilinear tap also reads.
+static void mapSpan(int first, int last, int srcSize, int dstSize, int &outFirst, int &outLast)
+{
+	outFirst = MAX((int)((int64)(first-1) * dstSize / srcSize) - 1, 0);
+	outLast = MIN((int)(((int64)(last+1) * dstSize + srcSize-1) / srcSize) + 1, dstSize);
+}
+
+void GraphicsManager::scaleRect(int *rect) const
+{
+	int left, right, top, bottom;
+	mapSpan(rect[0], rect[0]+rect[2], bmpwidth, picwidth, left, right);
+	mapSpan(rect[1], rect[1]+rect[3], bmpheight, picheight, top, bottom);
+
+	rect[0] = picx + left;
+	rect[1] = picy + top;
+	rect[2] = right - left;
+	rect[3] = bottom - top;
+}
+
+void GraphicsManager::drawScaled(const GraphicsKernels *kernels, byte *scan0, int stride, int left, int top, int right, int bottom) const
+{
+	// Converted in pieces small enough to stay in L1, straight into scan0
+	enum { kChunk = 256 };
+	byte indices[kChunk];
+	uint32 pixels[kChunk];
+
+	int bytesPerPixel = getBytesPerPixel();
+	bool blend = scalefilter == kScaleBilinear && format != kPixelFormatIndexed8;
+
+	for(int y=top; y<bottom; y++)
+	{
+		byte* dstRow = scan0 + (picy+y)*stride + (picx+left)*bytesPerPixel;
+
+		if(!blend)
+		{
+			int sy = getNearestTap(y, bmpheight, picheight);
+			const byte* srcRow = source + sy*sourcepitch;
+
+			if(format == kPixelFormatIndexed8)
+			{
+				kernels->scaleRowNearest(dstRow, srcRow, xnearest + left, right-left, bmpwidth);
+				continue;
+			}
+
+			for(int x=left; x<right; x+=kChunk)
+			{
+				int count = MIN(right-x, (int)kChunk);
+				kernels->scaleRowNearest(indices, srcRow, xnearest + x, count, bmpwidth);
+				convertRow(kernels, dstRow + (x-left)*bytesPerPixel, indices, count);
+			}
+			continue;
+		}
+
+		uint32 sy, yweight;
+		getBilinearTap(y, bmpheight, picheight, sy, yweight);
+		const byte* row0 = source + sy*sourcepitch;
+		const byte* row1 = row0 + sourcepitch;
+
+		if(format == kPixelFormatBGRA32)
+		{
+			kernels->scaleRowBilinear(dstRow, row0, row1, palettelut, xindex + left, xweight + left, yweight, right-left, bmpwidth);
+			continue;
+		}
+
+		for(int x=left; x<right; x+=kChunk)
+		{
+			int count = MIN(right-x, (int)kChunk);
+			kernels->scaleRowBilinear((byte*)pixels, row0, row1, palettelut, xindex + x, xweight + x, yweight, count, bmpwidth);
+
+			if(format == kPixelFormatRGB565)
+				kernels->packRow16(dstRow + (x-left)*2, pixels, count);
+			else
+				kernels->packRow24(dstRow + (x-left)*3, pixels, count);
+		}
+	}
+}
+
+void GraphicsManager::toBitmapScaled(void* scan0, int stride, bool dirtyOnly)
+{
+	const GraphicsKernels *kernels = s_kernels;
+	int bytesPerPixel = getBytesPerPixel();
+
+	if(!dirtyOnly || barsdirty)
+	{
+		for(int y=0; y<outheight; y++)
+		{
+			byte* dstRow = (byte*)scan0 + y*stride;
+
+			if(y < picy || y >= picy+picheight)
+			{
+				fillBlack(dstRow, outwidth);
+				continue;
+			}
+
+			fillBlack(dstRow, picx);
+			fillBlack(dstRow + (picx+picwidth)*bytesPerPixel, outwidth-picx-picwidth);
+		}
+
+		barsdirty = false;
+	}
+
+	if(!dirtyOnly)
+	{
+		drawScaled(kernels, (byte*)scan0, stride, 0, 0, picwidth, picheight);
+		return;
+	}
+
+	if(!anydirty)
+		return;
+
+	for(int by=0; by<dirtyheight; by++)
+	{
+		const byte* dirtyRow = dirty + by*dirtywidth;
+		int top, bottom;
+		mapSpan(by*8, MIN(by*8+8, bmpheight), bmpheight, picheight, top, bottom);
+
+		for(int bx=0; bx<dirtywidth; )
+		{
+			if(!dirtyRow[bx])
+			{
+				bx++;
+				continue;
+			}
+
+			int first = bx;
+			while(bx<dirtywidth && dirtyRow[bx])
+				bx++;
+
+			int left, right;
+			mapSpan(first*8, MIN(bx*8, bmpwidth), bmpwidth, picwidth, left, right);
+			drawScaled(kernels, (byte*)scan0, stride, left, top, right, bottom);
+		}
+	}
+}
+
+void GraphicsManager::toBitmap(void* scan0, int stride, bool dirtyOnly)
+{
+	const GraphicsKernels *kernels = s_kernels;
+	int bytesPerPixel = getBytesPerPixel();
+
+	if(!source)
+	{
+		// Nothing drawn yet
+		for(int y=0; y<outheight; y++)
+			fillBlack((byte*)scan0 + y*stride, outwidth);
+	}
+	else if(scalefilter != kScaleNone)
+	{
+		toBitmapScaled(scan0, stride, dirtyOnly);
+	}
+	else if(!dirtyOnly)
+	{
+		for(int y=0; y<bmpheight; y++)
+		{
+			const byte* srcRow = source + y*sourcepitch;
+			byte* dstRow = (byte*)scan0 + y*stride;
+
+			convertRow(kernels, dstRow, srcRow, bmpwidth);
+		}
+	}
+	else if(anydirty)
+	{
+		for(int by=0; by<dirtyheight; by++)
+		{
+			const byte* dirtyRow = dirty + by*dirtywidth;
+			int bottom = MIN(by*8+8, bmpheight);
+
+			for(int bx=0; bx<dirtywidth; )
+			{
+				if(!dirtyRow[bx])
+				{
+					bx++;
+					continue;
+				}
+
+				int left = bx*8;
+				while(bx<dirtywidth && dirtyRow[bx])
+					bx++;
+				int right = MIN(bx*8, bmpwidth);
+
+				for(int y=by*8; y<bottom; y++)
+				{
+					const byte* srcRow = source + y*sourcepitch + left;
+					byte* dstRow = (byte*)scan0 + y*stride + left*bytesPerPixel;
+
+					convertRow(kernels, dstRow, srcRow, right-left);
+				}
+			}
+		}
+	}
+
+	memset(dirty, 0, dirtywidth*dirtyheight);
+	anydirty = false;
+}
+
+int GraphicsManager::getMipLevelCount() const
+{
+	int levels = 1;
+
+	for(int w=outwidth, h=outheight; w>1 || h>1; levels++)
+	{
+		w = MAX(w/2, 1);
+		h = MAX(h/2, 1);
+	}
+
+	return levels;
+}
+
+int GraphicsManager::getMipChainSize(int levels) const
+{
+	if(format != kPixelFormatBGR24 && format != kPixelFormatBGRA32)
+		return 0;
+
+	if(levels <= 0 || levels > getMipLevelCount())
+		levels = getMipLevelCount();
+
+	int size = 0;
+	for(int i=0; i<levels; i++)
+		size += MAX(outwidth>>i, 1) * MAX(outheight>>i, 1) * getBytesPerPixel();
+
+	return size;
+}
+
+int GraphicsManager::toMipChain(void* buffer, int levels, bool dirtyOnly)
+{
+	if(format != kPixelFormatBGR24 && format != kPixelFormatBGRA32)
+		return 0;
+
+	if(levels <= 0 || levels > getMipLevelCount())
+		levels = getMipLevelCount();
+
+	const GraphicsKernels *kernels = s_kernels;
+	int bytesPerPixel = getBytesPerPixel();
+
+	// What changed at the current level, carried down one level at a time.
+	// Past kMaxMipRects it's one rect around everything.
+	enum { kMaxMipRects = 64 };
+	int rects[kMaxMipRects*4] = { 0, 0, outwidth, outheight };
+	int rectCount = 1;
+
+	// The bars aren't part of any dirty rect, and only scaled output has them
+	if(dirtyOnly && source && !(scalefilter != kScaleNone && barsdirty))
+		rectCount = getDirtyRects(rects, kMaxMipRects);
+
+	toBitmap(buffer, outwidth*bytesPerPixel, dirtyOnly);
+
+	byte* src = (byte*)buffer;
+	int srcWidth = outwidth;
+	int srcHeight = outheight;
+
+	for(int level=1; level<levels; level++)
+	{
+		int dstWidth = MAX(srcWidth/2, 1);
+		int dstHeight = MAX(srcHeight/2, 1);
+		int srcStride = srcWidth*bytesPerPixel;
+		int dstStride = dstWidth*bytesPerPixel;
+		byte* dst = src + srcStride*srcHeight;
+
+		// One-pixel rows or columns average with themselves
+		int nextRow = srcHeight > 1 ? srcStride : 0;
+		int step = srcWidth > 1 ? bytesPerPixel : 0;
+
+		for(int i=0; i<rectCount; i++)
 		{
-			dstRow[0] = srcRow[2];
-			dstRow[1] = srcRow[1];
-			dstRow[2] = srcRow[0];
+			int* rect = rects + i*4;
+			int left = rect[0]/2;
+			int top = rect[1]/2;
+			int right = MIN((rect[0]+rect[2]+1)/2, dstWidth);
+			int bottom = MIN((rect[1]+rect[3]+1)/2, dstHeight);
 
-			srcRow+=3;
-			dstRow+=3;
+			for(int y=top; y<bottom; y++)
+			{
+				const byte* row0 = src + y*2*srcStride + left*2*bytesPerPixel;
+				kernels->downsampleRow(dst + y*dstStride + left*bytesPerPixel, row0, row0 + nextRow, right-left, bytesPerPixel, step);
+			}
+
+			rect[0] = left;
+			rect[1] = top;
+			rect[2] = MAX(right-left, 0);
+			rect[3] = MAX(bottom-top, 0);
 		}
+
+		src = dst;
+		srcWidth = dstWidth;
+		srcHeight = dstHeight;
 	}
+
+	return levels;
 }
 
-void GraphicsManager::blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch) {
-	for(int ty=0; ty<height; ty++)
+int GraphicsManager::getDirtyRects(int *rects, int maxRects) const
+{
+	if(!anydirty)
+		return 0;
+
+	// Runs of dirty blocks along each block row, merged downwards with the
+	// run right above when they span the same columns. Any rect that
+	// reaches down to this row can be extended, however tall it already is.
+	int count = 0;
+	int minX = bmpwidth, minY = bmpheight, maxX = 0, maxY = 0;
+
+	for(int by=0; by<dirtyheight; by++)
+	{
+		const byte* dirtyRow = dirty + by*dirtywidth;
+		int top = by*8;
+		int bottom = MIN(top+8, bmpheight);
+		int rowFirst = MIN(count, maxRects);
+
+		for(int bx=0; bx<dirtywidth; )
+		{
+			if(!dirtyRow[bx])
+			{
+				bx++;
+				continue;
+			}
+
+			int left = bx*8;
+			while(bx<dirtywidth && dirtyRow[bx])
+				bx++;
+			int right = MIN(bx*8, bmpwidth);
+
+			minX = MIN(minX, left);
+			minY = MIN(minY, top);
+			maxX = MAX(maxX, right);
+			maxY = MAX(maxY, bottom);
+
+			if(count > maxRects)
+				continue;
+
+			int i;
+			for(i=0; i<rowFirst; i++)
+			{
+				int* rect = rects + i*4;
+				if(rect[0] == left && rect[2] == right-left && rect[1]+rect[3] == top)
+				{
+					rect[3] = bottom - rect[1];
+					break;
+				}
+			}
+
+			if(i < rowFirst)
+				continue;
+
+			if(count < maxRects)
+			{
+				int* rect = rects + count*4;
+				rect[0] = left;
+				rect[1] = top;
+				rect[2] = right-left;
+				rect[3] = bottom-top;
+			}
+
+			count++;
+		}
+	}
+
+	if(count > maxRects)
+	{
+		if(maxRects < 1)
+			return 0;
+
+		rects[0] = minX;
+		rects[1] = minY;
+		rects[2] = maxX-minX;
+		rects[3] = maxY-minY;
+		count = 1;
+	}
+
+	if(scalefilter != kScaleNone)
 	{
-		int curY = y+ty;
+		for(int i=0; i<count; i++)
+			scaleRect(rects + i*4);
+	}
+
+	return count;
+}
+
+void GraphicsManager::detach()
+{
+	if(!source || source == surface)
+		return;
+
+	if(!surface)
+		surface = new byte[bmpwidth*bmpheight];
+
+	for(int y=0; y<bmpheight; y++)
+		memcpy(surface + y*bmpwidth, source + y*sourcepitch, bmpwidth);
+
+	source = surface;
+	sourcepitch = bmpwidth;
+}
 
-		const byte* ptrRow = ptr + curY*pitch;
-		byte* bmpRow = bmp + curY*width*3;
+void GraphicsManager::takeFrame(GraphicsManager &src, bool dirtyOnly)
+{
+	// Partial copies build on what we showed before, so that has to be ours
+	detach();
+
+	if(!surface)
+		surface = new byte[bmpwidth*bmpheight];
 
-		for(int tx=0; tx<width; tx++)
+	if(!src.source)
+	{
+		memset(surface, 0, bmpwidth*bmpheight);
+	}
+	else if(!dirtyOnly || !source)
+	{
+		for(int y=0; y<bmpheight; y++)
+			memcpy(surface + y*bmpwidth, src.source + y*src.sourcepitch, bmpwidth);
+	}
+	else if(src.anydirty)
+	{
+		for(int by=0; by<dirtyheight; by++)
 		{
-			int curX = x+tx;
+			const byte* dirtyRow = src.dirty + by*dirtywidth;
+			int bottom = MIN(by*8+8, bmpheight);
 
-			byte* palEntry = palette + ptrRow[curX]*3;
+			for(int bx=0; bx<dirtywidth; )
+			{
+				if(!dirtyRow[bx])
+				{
+					bx++;
+					continue;
+				}
 
-			bmpRow[0] = palEntry[0];
-			bmpRow[1] = palEntry[1];
-			bmpRow[2] = palEntry[2];
+				int left = bx*8;
+				while(bx<dirtywidth && dirtyRow[bx])
+					bx++;
+				int right = MIN(bx*8, bmpwidth);
 
-			bmpRow+=3;
+				for(int y=by*8; y<bottom; y++)
+					memcpy(surface + y*bmpwidth + left, src.source + y*src.sourcepitch + left, right-left);
+			}
 		}
 	}
+
+	source = surface;
+	sourcepitch = bmpwidth;
+
+	// The pixels mean nothing without the palette they were drawn with
+	setPalette(src.palette, 0, 256);
+
+	if(src.anydirty)
+	{
+		for(int i=0; i<dirtywidth*dirtyheight; i++)
+			dirty[i] |= src.dirty[i];
+
+		anydirty = true;
+	}
+
+	memset(src.dirty, 0, dirtywidth*dirtyheight);
+	src.anydirty = false;
+}
+
+void GraphicsManager::markDirty(int blockX, int blockY, int blockCount)
+{
+	memset(dirty + blockY*dirtywidth + blockX, 1, blockCount);
+	anydirty = true;
+}
+
+void GraphicsManager::blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch, const byte *dirtyBlocks) {
+	// Nothing is converted here; toBitmap() reads the surface when the host
+	// actually wants the frame
+	source = ptr;
+	sourcepitch = pitch;
+
+	if (!dirtyBlocks) {
+		for(uint by=y/8; by<(y+height+7)/8; by++)
+			markDirty(x/8, by, (x+width+7)/8 - x/8);
+		return;
+	}
+
+	uint blocksWide = (width + 7) / 8;
+
+	for(uint by=0; by*8<height; by++)
+	{
+		const byte* dirtyRow = dirtyBlocks + by*blocksWide;
+
+		for(uint bx=0; bx<blocksWide; )
+		{
+			if(!dirtyRow[bx])
+			{
+				bx++;
+				continue;
+			}
+
+			uint first = bx;
+			while(bx<blocksWide && dirtyRow[bx])
+				bx++;
+
+			markDirty((x+first*8)/8, (y/8)+by, bx-first);
+		}
+	}
+
 	/*if (width == 0 || height == 0)
 		return;
 
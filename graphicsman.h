@@ -23,26 +23,155 @@
 #ifndef GRAPHICSMAN_H
 #define GRAPHICSMAN_H
 
+#include "cpu.h"
 #include "types.h"
 #include <Windows.h>
 
+/** Select the palette conversion kernels for the given tier. */
+void bindGraphicsKernels(CPUTier tier);
+
+struct GraphicsKernels;
+
 class GraphicsManager {
 public:
+	enum PixelFormat {
+		kPixelFormatBGR24 = 0,
+		kPixelFormatBGRA32 = 1,  // alpha is always 255
+		kPixelFormatRGB565 = 2,
+		kPixelFormatIndexed8 = 3 // palette indices; see getPalette()
+	};
+
+	enum ScaleFilter {
+		kScaleNone = 0,
+		kScaleNearest = 1,
+		kScaleBilinear = 2 // nearest for indexed output
+	};
+
 	GraphicsManager();
 	~GraphicsManager();
 
 	bool init(uint width, uint height, bool highColor);
-	void blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch);
+
+	/**
+	 * Show an 8bpp surface. It isn't copied: toBitmap() converts straight
+	 * from ptr, so it has to stay valid and unchanged until the next blit()
+	 * or takeFrame(). If dirtyBlocks is given (one byte per 8x8 block of
+	 * the surface, nonzero where it changed since the last blit), only
+	 * those blocks are marked for conversion.
+	 */
+	void blit(const byte *ptr, uint x, uint y, uint width, uint height, uint pitch, const byte *dirtyBlocks = 0);
 	void update();
 	void setPalette(const byte *ptr, uint start, uint count);
 
-	void toBitmap(void* scan0, int stride);
+	/**
+	 * Set what toBitmap() writes. Everything is marked changed, since
+	 * nothing the caller holds is in the new format yet.
+	 */
+	void setPixelFormat(PixelFormat newFormat);
+	PixelFormat getPixelFormat() const { return format; }
+	int getBytesPerPixel() const;
+
+	/**
+	 * Have toBitmap() write the frame scaled to width x height (0 for the
+	 * frame's own width, at 4:3 with aspect). With aspect, the picture is
+	 * fitted inside at 4:3 and the rest is black. kScaleNone turns scaling
+	 * off again. Everything is marked changed.
+	 */
+	void setScaling(ScaleFilter filter, bool aspect, int width, int height);
+	int getOutputWidth() const { return outwidth; }
+	int getOutputHeight() const { return outheight; }
+
+	/**
+	 * Copy the current palette (256 RGB triplets) into dst. Returns whether
+	 * it changed since the last call.
+	 */
+	bool getPalette(byte *dst);
+
+	/**
+	 * Convert the frame into a bitmap of the current pixel format and
+	 * output size. With dirtyOnly, only what changed since the last call is
+	 * written and the rest of scan0 is expected to still hold the previous
+	 * frame.
+	 */
+	void toBitmap(void* scan0, int stride, bool dirtyOnly = false);
+
+	/**
+	 * toBitmap() into buffer as the first level of a mip chain, followed
+	 * by each smaller level down to 1x1 (or levels of them, if more than
+	 * 0), averaged over 2x2 blocks. Level n is max(1, width >> n) by
+	 * max(1, height >> n) with rows packed tightly. With dirtyOnly, only
+	 * what the changed rects reach on each level is recomputed and buffer
+	 * must still hold the previous chain. Only the 24 and 32-bit formats
+	 * can be filtered; returns the number of levels written, else 0.
+	 */
+	int toMipChain(void* buffer, int levels, bool dirtyOnly = false);
+	int getMipLevelCount() const;
+
+	/** Bytes toMipChain() needs for that many levels, or 0 if the format can't be filtered. */
+	int getMipChainSize(int levels) const;
+
+	/**
+	 * Take a copy of the frame shown by another manager of the same size,
+	 * along with its palette and what changed in it. With dirtyOnly, only
+	 * the changed blocks are copied and the rest of our frame must already
+	 * match.
+	 */
+	void takeFrame(GraphicsManager &src, bool dirtyOnly);
+
+	/**
+	 * Copy a frame borrowed from blit() into our own surface, so whoever
+	 * owns that buffer can draw into it again without changing ours.
+	 */
+	void detach();
+
+	/**
+	 * Whether anything changed since the last toBitmap(). With indexed
+	 * output a new palette counts too, until getPalette() picks it up.
+	 */
+	bool isDirty() const { return anydirty || (newpalette && format == kPixelFormatIndexed8); }
+
+	/**
+	 * Fill rects with x, y, width, height quads covering what changed since
+	 * the last toBitmap(), in output pixels, and return how many there are. If more than
+	 * maxRects would be needed, a single bounding rect is returned instead.
+	 */
+	int getDirtyRects(int *rects, int maxRects) const;
 
 private:
+	void markDirty(int blockX, int blockY, int blockCount);
+	void convertRow(const GraphicsKernels *kernels, byte *dst, const byte *src, uint width) const;
+	void fillBlack(byte *dst, int width) const;
+	void toBitmapScaled(void* scan0, int stride, bool dirtyOnly);
+	void drawScaled(const GraphicsKernels *kernels, byte *scan0, int stride, int left, int top, int right, int bottom) const;
+	void scaleRect(int *rect) const;
+
+	PixelFormat format;
 	byte *palette;
-	byte* bmp;
+	uint32 palettelut[256]; // palette as B, G, R, 255 words for the expand kernels
+	bool newpalette; // changed since the last getPalette()
 	int bmpwidth;
 	int bmpheight;
+
+	// The 8bpp frame toBitmap() converts: either borrowed from blit() or
+	// our own surface, filled by takeFrame()
+	const byte* source;
+	int sourcepitch;
+	byte* surface;
+
+	// Output size, and where the picture sits inside it
+	ScaleFilter scalefilter;
+	int outwidth, outheight;
+	int picx, picy, picwidth, picheight;
+	uint32 *xnearest; // source column for each picture column
+	uint32 *xindex;   // left source column for bilinear...
+	uint32 *xweight;  // ...and the weight (0-256) of the one right of it
+	bool barsdirty;
+
+	// Which 8x8 blocks changed since the last toBitmap()
+	byte *dirty;
+	int dirtywidth;
+	int dirtyheight;
+	bool anydirty;
 };
 
 #endif
@@ -27,8 +27,192 @@
 #include <string.h> // for size_t
 #include "audiostream.h"
 #include "pcm.h"
+#include "simd.h"
 #include "util.h"
 
+/**
+ * Convert big endian 16-bit samples to native ones.
+ */
+typedef void (*SwapSamplesProc)(int16 *dst, const byte *src, uint32 count);
+
+static void swapSamplesScalar(int16 *dst, const byte *src, uint32 count) {
+	while (count--) {
+		*dst++ = READ_BE_UINT16(src);
+		src += 2;
+	}
+}
+
+#ifdef SMUSH_SIMD_SSE2
+
+static void swapSamplesSSE2(int16 *dst, const byte *src, uint32 count) {
+	for (; count >= 8; count -= 8) {
+		__m128i samples = _mm_loadu_si128((const __m128i *)src);
+		samples = _mm_or_si128(_mm_slli_epi16(samples, 8), _mm_srli_epi16(samples, 8));
+		_mm_storeu_si128((__m128i *)dst, samples);
+
+		src += 16;
+		dst += 8;
+	}
+
+	swapSamplesScalar(dst, src, count);
+}
+
+SMUSH_TARGET_AVX2 static void swapSamplesAVX2(int16 *dst, const byte *src, uint32 count) {
+	for (; count >= 16; count -= 16) {
+		__m256i samples = _mm256_loadu_si256((const __m256i *)src);
+		samples = _mm256_or_si256(_mm256_slli_epi16(samples, 8), _mm256_srli_epi16(samples, 8));
+		_mm256_storeu_si256((__m256i *)dst, samples);
+
+		src += 32;
+		dst += 16;
+	}
+
+	swapSamplesSSE2(dst, src, count);
+}
+
+#endif
+
+#ifdef SMUSH_SIMD_NEON
+
+static void swapSamplesNEON(int16 *dst, const byte *src, uint32 count) {
+	for (; count >= 8; count -= 8) {
+		vst1q_u8((byte *)dst, vrev16q_u8(vld1q_u8(src)));
+
+		src += 16;
+		dst += 8;
+	}
+
+	swapSamplesScalar(dst, src, count);
+}
+
+#endif
+
+/**
+ * Decode stereo IACT samples. Each is a byte shifted left by the channel's
+ * shift, or 0x80 followed by a big endian 16-bit sample.
+ */
+typedef const byte *(*DecodeIACTProc)(int16 *dst, const byte *src, uint32 count, int leftShift, int rightShift);
+
+static const byte *decodeIACTScalar(int16 *dst, const byte *src, uint32 count, int leftShift, int rightShift) {
+	while (count--) {
+		byte value = *src++;
+		if (value == 0x80) {
+			*dst++ = READ_BE_UINT16(src);
+			src += 2;
+		} else {
+			*dst++ = (int8)value << leftShift;
+		}
+
+		value = *src++;
+		if (value == 0x80) {
+			*dst++ = READ_BE_UINT16(src);
+			src += 2;
+		} else {
+			*dst++ = (int8)value << rightShift;
+		}
+	}
+
+	return src;
+}
+
+#ifdef SMUSH_SIMD_SSE2
+
+static const byte *decodeIACTSSE2(int16 *dst, const byte *src, uint32 count, int leftShift, int rightShift) {
+	// Shifting by multiplying lets left and right use different shifts
+	const int16 left = (int16)(1 << leftShift);
+	const int16 right = (int16)(1 << rightShift);
+	const __m128i scale = _mm_setr_epi16(left, right, left, right, left, right, left, right);
+	const __m128i escape = _mm_set1_epi8((char)0x80);
+
+	// Every sample takes at least a byte, so the 16 byte loads stay inside the block
+	while (count >= 8) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, escape)) != 0) {
+			src = decodeIACTScalar(dst, src, 8, leftShift, rightShift);
+		} else {
+			__m128i sign = _mm_cmpgt_epi8(_mm_setzero_si128(), bytes);
+			_mm_storeu_si128((__m128i *)dst, _mm_mullo_epi16(_mm_unpacklo_epi8(bytes, sign), scale));
+			_mm_storeu_si128((__m128i *)(dst + 8), _mm_mullo_epi16(_mm_unpackhi_epi8(bytes, sign), scale));
+			src += 16;
+		}
+
+		dst += 16;
+		count -= 8;
+	}
+
+	return decodeIACTScalar(dst, src, count, leftShift, rightShift);
+}
+
+#endif
+
+#ifdef SMUSH_SIMD_NEON
+
+static const byte *decodeIACTNEON(int16 *dst, const byte *src, uint32 count, int leftShift, int rightShift) {
+	const int16 shifts[8] = { (int16)leftShift, (int16)rightShift, (int16)leftShift, (int16)rightShift,
+	                          (int16)leftShift, (int16)rightShift, (int16)leftShift, (int16)rightShift };
+	const int16x8_t shift = vld1q_s16(shifts);
+
+	// Every sample takes at least a byte, so the 16 byte loads stay inside the block
+	while (count >= 8) {
+		uint8x16_t bytes = vld1q_u8(src);
+		uint64x2_t escapes = vreinterpretq_u64_u8(vceqq_u8(bytes, vdupq_n_u8(0x80)));
+
+		if ((vgetq_lane_u64(escapes, 0) | vgetq_lane_u64(escapes, 1)) != 0) {
+			src = decodeIACTScalar(dst, src, 8, leftShift, rightShift);
+		} else {
+			int8x16_t samples = vreinterpretq_s8_u8(bytes);
+			vst1q_s16(dst, vshlq_s16(vmovl_s8(vget_low_s8(samples)), shift));
+			vst1q_s16(dst + 8, vshlq_s16(vmovl_s8(vget_high_s8(samples)), shift));
+			src += 16;
+		}
+
+		dst += 16;
+		count -= 8;
+	}
+
+	return decodeIACTScalar(dst, src, count, leftShift, rightShift);
+}
+
+#endif
+
+static SwapSamplesProc s_swapSamples = swapSamplesScalar;
+static DecodeIACTProc s_decodeIACT = decodeIACTScalar;
+
+void bindPCMKernels(CPUTier tier) {
+	switch (tier) {
+#ifdef SMUSH_SIMD_AVX2
+	case kCPUTierAVX512:
+	case kCPUTierAVX2:
+		s_swapSamples = swapSamplesAVX2;
+		s_decodeIACT = decodeIACTSSE2;
+		break;
+#endif
+#ifdef SMUSH_SIMD_SSE2
+	case kCPUTierSSSE3:
+	case kCPUTierSSE2:
+		s_swapSamples = swapSamplesSSE2;
+		s_decodeIACT = decodeIACTSSE2;
+		break;
+#endif
+#ifdef SMUSH_SIMD_NEON
+	case kCPUTierNEON:
+		s_swapSamples = swapSamplesNEON;
+		s_decodeIACT = decodeIACTNEON;
+		break;
+#endif
+	default:
+		s_swapSamples = swapSamplesScalar;
+		s_decodeIACT = decodeIACTScalar;
+	}
+}
+
+void decodeIACTBlock(int16 *dst, const byte *src) {
+	// The first byte holds the left and right shifts
+	byte shifts = *src++;
+	s_decodeIACT(dst, src, kIACTBlockSamples / 2, shifts >> 4, shifts & 0xF);
+}
+
 // This used to be an inline template function, but
 // buggy template function handling in MSVC6 forced
 // us to go with the macro approach. So far this is
@@ -70,6 +254,19 @@ public:
 
 template<bool is16Bit, bool isUnsigned, bool isLE>
 int PCMStream<is16Bit, isUnsigned, isLE>::readBuffer(int16 *buffer, const int numSamples) {
+	if (is16Bit && !isUnsigned) {
+		// Whole runs of signed 16-bit samples are a copy or a byte swap
+		uint32 samples = MIN<uint32>(numSamples, (_size - (uint32)(_curSample - _data)) / 2);
+
+		if (isLE)
+			memcpy(buffer, _curSample, samples * 2);
+		else
+			s_swapSamples(buffer, _curSample, samples);
+
+		_curSample += samples * 2;
+		return samples;
+	}
+
 	int samples = numSamples;
 
 	while (samples > 0 && !endOfData()) {
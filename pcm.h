@@ -27,6 +27,7 @@
 #ifndef PCM_H
 #define PCM_H
 
+#include "cpu.h"
 #include "types.h"
 
 /**
@@ -51,6 +52,18 @@ enum PCMFlags {
 
 class AudioStream;
 
+/** Select the sample conversion kernels for the given tier. */
+void bindPCMKernels(CPUTier tier);
+
+/** Samples (1024 stereo pairs) in one block of IACT audio. */
+const uint32 kIACTBlockSamples = 2048;
+
+/**
+ * Decode one compressed block of IACT audio (without its size prefix) into
+ * kIACTBlockSamples native 16-bit samples.
+ */
+void decodeIACTBlock(int16 *dst, const byte *src);
+
 /**
  * Creates an audio stream, which plays from the given stream.
  *
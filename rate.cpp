@@ -31,9 +31,13 @@
 // Based on the ScummVM code of the same name (GPLv2+)
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include "audiostream.h"
 #include "rate.h"
+#include "simd.h"
+#include "util.h"
 
 /**
  * The precision of the fractional (fixed point) type we define below.
@@ -59,15 +63,287 @@ enum {
 	ST_SAMPLE_MIN = (-ST_SAMPLE_MAX - 1L)
 };
 
-static void clampedAdd(int16& a, int b) {
-	register int val = a + b;
+/**
+ * Scale interleaved stereo samples by the given volumes (0x100 being unity)
+ * and add them to a 32-bit mix bus. Nothing is rounded or clamped until
+ * clampMixBus() turns the bus back into samples.
+ */
+typedef void (*MixStereoProc)(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume);
+
+/** Shift the bus back down to samples, saturating. */
+typedef void (*ClampMixBusProc)(int16 *outBuffer, const int32 *bus, uint32 samples);
+
+static void mixStereoScalar(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume) {
+	while (frames--) {
+		bus[0] += samples[0] * (int)leftVolume;
+		bus[1] += samples[1] * (int)rightVolume;
+
+		samples += 2;
+		bus += 2;
+	}
+}
+
+static void clampMixBusScalar(int16 *outBuffer, const int32 *bus, uint32 samples) {
+	while (samples--)
+		*outBuffer++ = CLIP<int32>(*bus++ >> MIX_BUS_BITS, ST_SAMPLE_MIN, ST_SAMPLE_MAX);
+}
+
+#ifdef SMUSH_SIMD_SSE2
+
+static void mixStereoSSE2(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume) {
+	const __m128i volume = _mm_set_epi16(rightVolume, leftVolume, rightVolume, leftVolume, rightVolume, leftVolume, rightVolume, leftVolume);
+
+	for (; frames >= 4; frames -= 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)samples);
+		__m128i lo = _mm_mullo_epi16(in, volume);
+		__m128i hi = _mm_mulhi_epi16(in, volume);
+
+		_mm_storeu_si128((__m128i *)bus, _mm_add_epi32(_mm_loadu_si128((const __m128i *)bus), _mm_unpacklo_epi16(lo, hi)));
+		_mm_storeu_si128((__m128i *)(bus + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(bus + 4)), _mm_unpackhi_epi16(lo, hi)));
+
+		samples += 8;
+		bus += 8;
+	}
+
+	mixStereoScalar(bus, samples, frames, leftVolume, rightVolume);
+}
+
+static void clampMixBusSSE2(int16 *outBuffer, const int32 *bus, uint32 samples) {
+	for (; samples >= 8; samples -= 8) {
+		__m128i first = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)bus), MIX_BUS_BITS);
+		__m128i second = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(bus + 4)), MIX_BUS_BITS);
+		_mm_storeu_si128((__m128i *)outBuffer, _mm_packs_epi32(first, second));
+
+		bus += 8;
+		outBuffer += 8;
+	}
+
+	clampMixBusScalar(outBuffer, bus, samples);
+}
+
+SMUSH_TARGET_AVX2 static void mixStereoAVX2(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume) {
+	const __m256i volume = _mm256_set_epi32(rightVolume, leftVolume, rightVolume, leftVolume, rightVolume, leftVolume, rightVolume, leftVolume);
+
+	for (; frames >= 4; frames -= 4) {
+		__m256i in = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)samples));
+		__m256i mixed = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)bus), _mm256_mullo_epi32(in, volume));
+		_mm256_storeu_si256((__m256i *)bus, mixed);
+
+		samples += 8;
+		bus += 8;
+	}
+
+	mixStereoScalar(bus, samples, frames, leftVolume, rightVolume);
+}
+
+SMUSH_TARGET_AVX2 static void clampMixBusAVX2(int16 *outBuffer, const int32 *bus, uint32 samples) {
+	for (; samples >= 16; samples -= 16) {
+		__m256i first = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)bus), MIX_BUS_BITS);
+		__m256i second = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(bus + 8)), MIX_BUS_BITS);
+
+		// packs works within each 128-bit lane, so put the quarters back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(first, second), 0xD8);
+		_mm256_storeu_si256((__m256i *)outBuffer, packed);
+
+		bus += 16;
+		outBuffer += 16;
+	}
+
+	clampMixBusSSE2(outBuffer, bus, samples);
+}
+
+#endif
+
+#ifdef SMUSH_SIMD_NEON
+
+static void mixStereoNEON(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume) {
+	const int16 volumes[4] = { (int16)leftVolume, (int16)rightVolume, (int16)leftVolume, (int16)rightVolume };
+	const int16x4_t volume = vld1_s16(volumes);
+
+	for (; frames >= 4; frames -= 4) {
+		int16x8_t in = vld1q_s16(samples);
+		vst1q_s32(bus, vmlal_s16(vld1q_s32(bus), vget_low_s16(in), volume));
+		vst1q_s32(bus + 4, vmlal_s16(vld1q_s32(bus + 4), vget_high_s16(in), volume));
+
+		samples += 8;
+		bus += 8;
+	}
+
+	mixStereoScalar(bus, samples, frames, leftVolume, rightVolume);
+}
+
+static void clampMixBusNEON(int16 *outBuffer, const int32 *bus, uint32 samples) {
+	for (; samples >= 8; samples -= 8) {
+		int16x4_t first = vqshrn_n_s32(vld1q_s32(bus), MIX_BUS_BITS);
+		int16x4_t second = vqshrn_n_s32(vld1q_s32(bus + 4), MIX_BUS_BITS);
+		vst1q_s16(outBuffer, vcombine_s16(first, second));
+
+		bus += 8;
+		outBuffer += 8;
+	}
+
+	clampMixBusScalar(outBuffer, bus, samples);
+}
+
+#endif
 
-	if (val > ST_SAMPLE_MAX)
-		val = ST_SAMPLE_MAX;
-	else if (val < ST_SAMPLE_MIN)
-		val = ST_SAMPLE_MIN;
+/**
+ * Taps per phase of the interpolation filter, and the fixed point scale of
+ * its coefficients (each phase sums to 1 << INTERPOLATE_BITS).
+ */
+enum {
+	INTERPOLATE_TAPS = 16,
+	INTERPOLATE_BITS = 14
+};
+
+/**
+ * Run one phase of the interpolation filter over stereo input. Output frame
+ * j is the filter applied to input frames j to j + INTERPOLATE_TAPS - 1, and
+ * goes to outBuffer[j * stride * 2].
+ */
+typedef void (*InterpolateStereoProc)(int16 *outBuffer, const int16 *samples, uint32 frames, const int16 *coefs, uint32 stride);
+
+static void interpolateStereoScalar(int16 *outBuffer, const int16 *samples, uint32 frames, const int16 *coefs, uint32 stride) {
+	while (frames--) {
+		int left = 0, right = 0;
+
+		for (int k = 0; k < INTERPOLATE_TAPS; k++) {
+			left += coefs[k] * samples[k * 2];
+			right += coefs[k] * samples[k * 2 + 1];
+		}
+
+		outBuffer[0] = CLIP<int>((left + (1 << (INTERPOLATE_BITS - 1))) >> INTERPOLATE_BITS, ST_SAMPLE_MIN, ST_SAMPLE_MAX);
+		outBuffer[1] = CLIP<int>((right + (1 << (INTERPOLATE_BITS - 1))) >> INTERPOLATE_BITS, ST_SAMPLE_MIN, ST_SAMPLE_MAX);
+
+		samples += 2;
+		outBuffer += stride * 2;
+	}
+}
+
+#ifdef SMUSH_SIMD_SSE2
+
+static void interpolateStereoSSE2(int16 *outBuffer, const int16 *samples, uint32 frames, const int16 *coefs, uint32 stride) {
+	// Each madd takes two neighbouring taps for the same channel
+	__m128i taps[INTERPOLATE_TAPS / 2];
+	for (int t = 0; t < INTERPOLATE_TAPS / 2; t++)
+		taps[t] = _mm_set1_epi32((uint16)coefs[t * 2] | ((uint32)(uint16)coefs[t * 2 + 1] << 16));
+
+	const __m128i round = _mm_set1_epi32(1 << (INTERPOLATE_BITS - 1));
+
+	for (; frames >= 4; frames -= 4) {
+		__m128i first = _mm_setzero_si128();
+		__m128i second = _mm_setzero_si128();
+
+		for (int t = 0; t < INTERPOLATE_TAPS / 2; t++) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(samples + t * 4));
+			__m128i b = _mm_loadu_si128((const __m128i *)(samples + t * 4 + 2));
+			first = _mm_add_epi32(first, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), taps[t]));
+			second = _mm_add_epi32(second, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), taps[t]));
+		}
+
+		first = _mm_srai_epi32(_mm_add_epi32(first, round), INTERPOLATE_BITS);
+		second = _mm_srai_epi32(_mm_add_epi32(second, round), INTERPOLATE_BITS);
+		__m128i result = _mm_packs_epi32(first, second);
+
+		if (stride == 1) {
+			_mm_storeu_si128((__m128i *)outBuffer, result);
+			outBuffer += 8;
+		} else {
+			for (int j = 0; j < 4; j++) {
+				int32 frame = _mm_cvtsi128_si32(result);
+				memcpy(outBuffer, &frame, 4);
+				result = _mm_srli_si128(result, 4);
+				outBuffer += stride * 2;
+			}
+		}
+
+		samples += 8;
+	}
+
+	interpolateStereoScalar(outBuffer, samples, frames, coefs, stride);
+}
+
+#endif
+
+#ifdef SMUSH_SIMD_NEON
+
+static void interpolateStereoNEON(int16 *outBuffer, const int16 *samples, uint32 frames, const int16 *coefs, uint32 stride) {
+	for (; frames >= 4; frames -= 4) {
+		int32x4_t first = vdupq_n_s32(0);
+		int32x4_t second = vdupq_n_s32(0);
+
+		for (int k = 0; k < INTERPOLATE_TAPS; k++) {
+			int16x8_t in = vld1q_s16(samples + k * 2);
+			first = vmlal_n_s16(first, vget_low_s16(in), coefs[k]);
+			second = vmlal_n_s16(second, vget_high_s16(in), coefs[k]);
+		}
+
+		int16x8_t result = vcombine_s16(vqrshrn_n_s32(first, INTERPOLATE_BITS), vqrshrn_n_s32(second, INTERPOLATE_BITS));
+
+		if (stride == 1) {
+			vst1q_s16(outBuffer, result);
+			outBuffer += 8;
+		} else {
+			int32x4_t frame = vreinterpretq_s32_s16(result);
+			vst1q_lane_s32((int32_t *)outBuffer, frame, 0);
+			vst1q_lane_s32((int32_t *)(outBuffer + stride * 2), frame, 1);
+			vst1q_lane_s32((int32_t *)(outBuffer + stride * 4), frame, 2);
+			vst1q_lane_s32((int32_t *)(outBuffer + stride * 6), frame, 3);
+			outBuffer += stride * 8;
+		}
+
+		samples += 8;
+	}
+
+	interpolateStereoScalar(outBuffer, samples, frames, coefs, stride);
+}
 
-	a = val;
+#endif
+
+static MixStereoProc s_mixStereo = mixStereoScalar;
+static ClampMixBusProc s_clampMixBus = clampMixBusScalar;
+static InterpolateStereoProc s_interpolateStereo = interpolateStereoScalar;
+
+void bindMixKernels(CPUTier tier) {
+	switch (tier) {
+#ifdef SMUSH_SIMD_AVX2
+	case kCPUTierAVX512:
+	case kCPUTierAVX2:
+		s_mixStereo = mixStereoAVX2;
+		s_clampMixBus = clampMixBusAVX2;
+		s_interpolateStereo = interpolateStereoSSE2;
+		break;
+#endif
+#ifdef SMUSH_SIMD_SSE2
+	case kCPUTierSSSE3:
+	case kCPUTierSSE2:
+		s_mixStereo = mixStereoSSE2;
+		s_clampMixBus = clampMixBusSSE2;
+		s_interpolateStereo = interpolateStereoSSE2;
+		break;
+#endif
+#ifdef SMUSH_SIMD_NEON
+	case kCPUTierNEON:
+		s_mixStereo = mixStereoNEON;
+		s_clampMixBus = clampMixBusNEON;
+		s_interpolateStereo = interpolateStereoNEON;
+		break;
+#endif
+	default:
+		s_mixStereo = mixStereoScalar;
+		s_clampMixBus = clampMixBusScalar;
+		s_interpolateStereo = interpolateStereoScalar;
+	}
+}
+
+void clampMixBus(int16 *outBuffer, const int32 *bus, uint32 samples) {
+	s_clampMixBus(outBuffer, bus, samples);
+}
+
+static void mixStereo(int32 *bus, const int16 *samples, uint32 frames, uint16 leftVolume, uint16 rightVolume) {
+	// A muted channel still uses up its input, it just adds nothing
+	if (leftVolume != 0 || rightVolume != 0)
+		s_mixStereo(bus, samples, frames, leftVolume, rightVolume);
 }
 
 /**
@@ -78,6 +354,44 @@ static void clampedAdd(int16& a, int b) {
  */
 #define INTERMEDIATE_BUFFER_SIZE 512
 
+/**
+ * Collects converted sample pairs and hands them to the mix kernel a block
+ * at a time, instead of clamping each sample as it is produced.
+ */
+template<bool reverseStereo>
+class MixBlock {
+	int16 _buf[INTERMEDIATE_BUFFER_SIZE];
+	int16 *_ptr;
+	int32 *_outBuffer;
+	uint16 _volume0, _volume1;
+
+public:
+	MixBlock(int32 *outBuffer, uint16 leftVolume, uint16 rightVolume) : _ptr(_buf), _outBuffer(outBuffer) {
+		_volume0 = reverseStereo ? rightVolume : leftVolume;
+		_volume1 = reverseStereo ? leftVolume : rightVolume;
+	}
+
+	~MixBlock() {
+		flush();
+	}
+
+	void push(int16 out0, int16 out1) {
+		_ptr[reverseStereo] = out0;
+		_ptr[reverseStereo ^ 1] = out1;
+		_ptr += 2;
+
+		if (_ptr == _buf + INTERMEDIATE_BUFFER_SIZE)
+			flush();
+	}
+
+	void flush() {
+		uint32 frames = (_ptr - _buf) / 2;
+		mixStereo(_outBuffer, _buf, frames, _volume0, _volume1);
+		_outBuffer += frames * 2;
+		_ptr = _buf;
+	}
+};
+
 
 /**
  * Audio rate converter based on simple resampling. Used when no
@@ -99,9 +413,16 @@ protected:
 
 public:
 	SimpleRateConverter(uint32 inRate, uint32 outRate);
-	int flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume);
+	int flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume);
+	void reset();
 };
 
+template<bool stereo, bool reverseStereo>
+void SimpleRateConverter<stereo, reverseStereo>::reset() {
+	_outPos = 1;
+	_inLen = 0;
+}
+
 
 /*
  * Prepare processing.
@@ -110,12 +431,10 @@ template<bool stereo, bool reverseStereo>
 SimpleRateConverter<stereo, reverseStereo>::SimpleRateConverter(uint32 inRate, uint32 outRate) {
 	assert((inRate % outRate) == 0);
 
-	_outPos = 1;
-
 	/* increment */
 	_outPosInc = inRate / outRate;
 
-	_inLen = 0;
+	reset();
 }
 
 /*
@@ -123,9 +442,10 @@ SimpleRateConverter<stereo, reverseStereo>::SimpleRateConverter(uint32 inRate, u
  * Return number of sample pairs processed.
  */
 template<bool stereo, bool reverseStereo>
-int SimpleRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
-	int16 *outStart = outBuffer;
-	int16 *outEnd = outBuffer + outSamples * 2;
+int SimpleRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
+	int32 *outStart = outBuffer;
+	int32 *outEnd = outBuffer + outSamples * 2;
+	MixBlock<reverseStereo> mix(outBuffer, leftVolume, rightVolume);
 
 	while (outBuffer < outEnd) {
 		// Read enough input samples so that _outPos >= 0
@@ -151,11 +471,8 @@ int SimpleRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int16 *
 		// Increment output position
 		_outPos += _outPosInc;
 
-		// output left channel
-		clampedAdd(outBuffer[reverseStereo], (out0 * (int)leftVolume) / 0x100);
-
-		// output right channel
-		clampedAdd(outBuffer[reverseStereo ^ 1], (out1 * (int)rightVolume) / 0x100);
+		// output left and right channel
+		mix.push(out0, out1);
 
 		outBuffer += 2;
 	}
@@ -194,9 +511,20 @@ protected:
 
 public:
 	LinearRateConverter(uint32 inRate, uint32 outRate);
-	int flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume);
+	int flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume);
+	void reset();
 };
 
+template<bool stereo, bool reverseStereo>
+void LinearRateConverter<stereo, reverseStereo>::reset() {
+	_outPos = FRAC_ONE;
+
+	_inLast0 = _inLast1 = 0;
+	_inCur0 = _inCur1 = 0;
+
+	_inLen = 0;
+}
+
 
 /*
  * Prepare processing.
@@ -205,8 +533,6 @@ template<bool stereo, bool reverseStereo>
 LinearRateConverter<stereo, reverseStereo>::LinearRateConverter(uint32 inRate, uint32 outRate) {
 	assert(inRate < 65536 && outRate < 65536);
 
-	_outPos = FRAC_ONE;
-
 	// Compute the linear interpolation increment.
 	// This will overflow if inrate >= 2^16, and underflow if outrate >= 2^16.
 	// Also, if the quotient of the two rate becomes too small / too big, that
@@ -214,10 +540,7 @@ LinearRateConverter<stereo, reverseStereo>::LinearRateConverter(uint32 inRate, u
 	// versa, I think we can live with that limitation ;-).
 	_outPosInc = (inRate << FRAC_BITS) / outRate;
 
-	_inLast0 = _inLast1 = 0;
-	_inCur0 = _inCur1 = 0;
-
-	_inLen = 0;
+	reset();
 }
 
 /*
@@ -225,9 +548,10 @@ LinearRateConverter<stereo, reverseStereo>::LinearRateConverter(uint32 inRate, u
  * Return number of sample pairs processed.
  */
 template<bool stereo, bool reverseStereo>
-int LinearRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
-	int16 *outStart = outBuffer;
-	int16 *outEnd = outBuffer + outSamples * 2;
+int LinearRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
+	int32 *outStart = outBuffer;
+	int32 *outEnd = outBuffer + outSamples * 2;
+	MixBlock<reverseStereo> mix(outBuffer, leftVolume, rightVolume);
 
 	while (outBuffer < outEnd) {
 		// Read enough input samples so that _outPos < 0
@@ -256,11 +580,8 @@ int LinearRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int16 *
 			int16 out0 = (int16)(_inLast0 + (((_inCur0 - _inLast0) * _outPos + FRAC_HALF) >> FRAC_BITS));
 			int16 out1 = (stereo ? (int16)(_inLast1 + (((_inCur1 - _inLast1) * _outPos + FRAC_HALF) >> FRAC_BITS)) : out0);
 
-			// output left channel
-			clampedAdd(outBuffer[reverseStereo], (out0 * (int)leftVolume) / 0x100);
-
-			// output right channel
-			clampedAdd(outBuffer[reverseStereo ^ 1], (out1 * (int)rightVolume) / 0x100);
+			// output left and right channel
+			mix.push(out0, out1);
 
 			outBuffer += 2;
 
@@ -284,7 +605,9 @@ public:
 		delete[] _buffer;
 	}
 
-	virtual int flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
+	virtual void reset() {}
+
+	virtual int flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
 		assert((input.getChannels() == 2) == stereo);
 
 		if (stereo)
@@ -300,20 +623,22 @@ public:
 		// Read up to 'outSamples' samples into our temporary buffer
 		uint32 len = input.readBuffer(_buffer, outSamples);
 
-		int16 *outStart = outBuffer;
-
 		// Mix the data into the output buffer
+		if (stereo && !reverseStereo) {
+			mixStereo(outBuffer, _buffer, len / 2, leftVolume, rightVolume);
+			return len / 2;
+		}
+
+		int32 *outStart = outBuffer;
+		MixBlock<reverseStereo> mix(outBuffer, leftVolume, rightVolume);
+
 		int16 *ptr = _buffer;
 		for (; len > 0; len -= (stereo ? 2 : 1)) {
 			int16 out0, out1;
 			out0 = *ptr++;
 			out1 = (stereo ? *ptr++ : out0);
 
-			// output left channel
-			clampedAdd(outBuffer[reverseStereo], (out0 * (int)leftVolume) / 0x100);
-
-			// output right channel
-			clampedAdd(outBuffer[reverseStereo ^ 1], (out1 * (int)rightVolume) / 0x100);
+			mix.push(out0, out1);
 
 			outBuffer += 2;
 		}
@@ -322,11 +647,162 @@ public:
 	}
 };
 
+/**
+ * Audio rate converter for raising the rate by a small whole factor (like
+ * IACT's 22050Hz to 44100Hz). Every output sample is a windowed sinc
+ * interpolation over INTERPOLATE_TAPS input samples, one filter phase per
+ * output sample between two input samples; phase 0 is the input itself.
+ * Input is read and filtered a block at a time.
+ */
+template<bool stereo, bool reverseStereo>
+class PolyphaseRateConverter : public RateConverter {
+protected:
+	enum {
+		HISTORY_FRAMES = INTERPOLATE_TAPS - 1,
+		BLOCK_FRAMES = INTERMEDIATE_BUFFER_SIZE / 2
+	};
+
+	/** input frames: the last HISTORY_FRAMES of the previous block, then the new ones */
+	int16 _inBuf[(HISTORY_FRAMES + BLOCK_FRAMES) * 2];
+
+	/** filtered output frames waiting to be mixed */
+	int16 *_outBuf;
+	uint32 _outPos, _outLen;
+
+	uint32 _factor;
+	int16 (*_coefs)[INTERPOLATE_TAPS];
+
+	uint32 fillBlock(AudioStream &input, uint32 frames);
+
+public:
+	PolyphaseRateConverter(uint32 inRate, uint32 outRate);
+	~PolyphaseRateConverter();
+	int flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume);
+	void reset();
+};
+
+template<bool stereo, bool reverseStereo>
+PolyphaseRateConverter<stereo, reverseStereo>::PolyphaseRateConverter(uint32 inRate, uint32 outRate) {
+	assert((outRate % inRate) == 0);
+
+	_factor = outRate / inRate;
+	_coefs = new int16[_factor][INTERPOLATE_TAPS];
+	_outBuf = new int16[BLOCK_FRAMES * _factor * 2];
+	reset();
+
+	// Output sample p / _factor past input sample 7 of the taps. The cutoff is
+	// the input rate's Nyquist frequency, and each phase is scaled to a gain
+	// of exactly 1 so a constant signal stays constant.
+	const double pi = 3.14159265358979323846;
+
+	for (uint32 p = 0; p < _factor; p++) {
+		double taps[INTERPOLATE_TAPS];
+		double sum = 0;
+
+		for (int k = 0; k < INTERPOLATE_TAPS; k++) {
+			double t = (INTERPOLATE_TAPS / 2 - 1) - k + (double)p / _factor;
+			double sinc = (t == 0) ? 1.0 : sin(pi * t) / (pi * t);
+			double window = 0.42 + 0.5 * cos(pi * t / (INTERPOLATE_TAPS / 2)) + 0.08 * cos(2 * pi * t / (INTERPOLATE_TAPS / 2));
+
+			taps[k] = sinc * window;
+			sum += taps[k];
+		}
+
+		int total = 0;
+		for (int k = 0; k < INTERPOLATE_TAPS; k++) {
+			_coefs[p][k] = (int16)floor(taps[k] / sum * (1 << INTERPOLATE_BITS) + 0.5);
+			total += _coefs[p][k];
+		}
+
+		// Put the rounding error on the nearest tap
+		_coefs[p][INTERPOLATE_TAPS / 2 - 1] += (1 << INTERPOLATE_BITS) - total;
+	}
+}
+
+template<bool stereo, bool reverseStereo>
+PolyphaseRateConverter<stereo, reverseStereo>::~PolyphaseRateConverter() {
+	delete[] _coefs;
+	delete[] _outBuf;
+}
+
+template<bool stereo, bool reverseStereo>
+void PolyphaseRateConverter<stereo, reverseStereo>::reset() {
+	_outPos = _outLen = 0;
+	memset(_inBuf, 0, sizeof(_inBuf));
+}
+
+/*
+ * Read up to frames new input frames and filter them into _outBuf.
+ * Return the number of input frames read.
+ */
+template<bool stereo, bool reverseStereo>
+uint32 PolyphaseRateConverter<stereo, reverseStereo>::fillBlock(AudioStream &input, uint32 frames) {
+	int16 *in = _inBuf + HISTORY_FRAMES * 2;
+	int len;
+
+	if (stereo) {
+		len = input.readBuffer(in, frames * 2);
+		if (len <= 0)
+			return 0;
+
+		frames = len / 2;
+
+		if (reverseStereo)
+			for (uint32 i = 0; i < frames; i++)
+				SWAP(in[i * 2], in[i * 2 + 1]);
+	} else {
+		// Read into the back half and spread each sample to both channels
+		len = input.readBuffer(in + frames, frames);
+		if (len <= 0)
+			return 0;
+
+		const int16 *src = in + frames;
+		frames = len;
+
+		for (uint32 i = 0; i < frames; i++)
+			in[i * 2] = in[i * 2 + 1] = src[i];
+	}
+
+	for (uint32 p = 0; p < _factor; p++)
+		s_interpolateStereo(_outBuf + p * 2, _inBuf, frames, _coefs[p], _factor);
+
+	// Keep the tail around for the next block's taps
+	memmove(_inBuf, _inBuf + frames * 2, HISTORY_FRAMES * 2 * sizeof(int16));
+
+	_outPos = 0;
+	_outLen = frames * _factor;
+	return frames;
+}
+
+template<bool stereo, bool reverseStereo>
+int PolyphaseRateConverter<stereo, reverseStereo>::flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) {
+	uint32 written = 0;
+
+	while (written < outSamples) {
+		if (_outPos == _outLen) {
+			// Only read as much as this call still needs
+			uint32 frames = MIN<uint32>(BLOCK_FRAMES, (outSamples - written + _factor - 1) / _factor);
+
+			if (fillBlock(input, frames) == 0)
+				break;
+		}
+
+		uint32 frames = MIN<uint32>(_outLen - _outPos, outSamples - written);
+		mixStereo(outBuffer + written * 2, _outBuf + _outPos * 2, frames, leftVolume, rightVolume);
+		_outPos += frames;
+		written += frames;
+	}
+
+	return written;
+}
+
 template<bool stereo, bool reverseStereo>
 RateConverter *makeRateConverter(uint32 inRate, uint32 outRate) {
 	if (inRate != outRate) {
 		if ((inRate % outRate) == 0) {
 			return new SimpleRateConverter<stereo, reverseStereo>(inRate, outRate);
+		} else if (outRate > inRate && (outRate % inRate) == 0 && outRate / inRate <= 8) {
+			return new PolyphaseRateConverter<stereo, reverseStereo>(inRate, outRate);
 		} else {
 			return new LinearRateConverter<stereo, reverseStereo>(inRate, outRate);
 		}
@@ -25,10 +25,25 @@
 #ifndef RATE_H
 #define RATE_H
 
+#include "cpu.h"
 #include "types.h"
 
 class AudioStream;
 
+/** Select the sample mixing kernels for the given tier. */
+void bindMixKernels(CPUTier tier);
+
+/**
+ * Converters mix into a bus of 32-bit samples scaled up by MIX_BUS_BITS
+ * (the volume's 0x100 for unity), so no channel clamps on its own.
+ */
+enum {
+	MIX_BUS_BITS = 8
+};
+
+/** Turn a mix bus back into 16-bit samples, clamping once. */
+void clampMixBus(int16 *outBuffer, const int32 *bus, uint32 samples);
+
 class RateConverter {
 public:
 	RateConverter() {}
@@ -37,7 +52,10 @@ public:
 	/**
 	 * @return Number of sample pairs written into the buffer.
 	 */
-	virtual int flow(AudioStream &input, int16 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) = 0;
+	virtual int flow(AudioStream &input, int32 *outBuffer, uint32 outSamples, uint16 leftVolume, uint16 rightVolume) = 0;
+
+	/** Forget the previous stream, so the converter can be used for a new one. */
+	virtual void reset() = 0;
 };
 
 RateConverter *makeRateConverter(uint32 inRate, uint32 outRate, bool stereo, bool reverseStereo = false);
@@ -0,0 +1,51 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+// Which vector instruction sets the kernels may be built with.
+//
+// SSE2 is part of the x86 baseline we ship (MSVC defaults to /arch:SSE2).
+// SSSE3 and AVX2 kernels are always compiled in as well, but may only run
+// when cpu.cpp detected support for them. MSVC allows the intrinsics without
+// /arch, GCC/Clang need the per-function target attributes below.
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define SMUSH_SIMD_SSE2
+	#define SMUSH_SIMD_AVX2
+	#include <emmintrin.h>
+	#include <immintrin.h>
+#elif defined(_M_ARM) || defined(_M_ARM64) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define SMUSH_SIMD_NEON
+	#include <arm_neon.h>
+#endif
+
+#if defined(SMUSH_SIMD_SSE2) && (defined(__GNUC__) || defined(__clang__))
+	#define SMUSH_TARGET_SSSE3 __attribute__((target("ssse3")))
+	#define SMUSH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+	#define SMUSH_TARGET_SSSE3
+	#define SMUSH_TARGET_AVX2
+#endif
+
+#endif
@@ -1,7 +1,9 @@
 #include "smith.h"
 #include "audioman.h"
+#include "cpu.h"
 #include "smushvideo.h"
 #include "graphicsman.h"
+#include "stream.h"
 
 extern "C"
 {
@@ -28,7 +30,7 @@ extern "C"
 	{
 		smith = _smith;
 
-
+		initKernels();
 
 		return true;
 	}
@@ -47,17 +49,24 @@ extern "C"
 		AudioManager* audio;
 		SMUSHVideo* video;
 		GraphicsManager* gfx;
+		PushReadStream* push; // owned by video; null unless loaded with smushLoadStreaming
 	};
 
-	SMUSH* __cdecl smushLoad(void* pBuffer, int len)
+	static SMUSH* createSmush(SeekableReadStream* stream, PushReadStream* push = nullptr)
 	{
 		SMUSH* smush = new SMUSH;
+		smush->push = push;
 
 		smush->audio = new AudioManager();
 		smush->audio->init();
 
 		smush->video = new SMUSHVideo(*smush->audio);
-		smush->video->load(pBuffer, len);
+		if (push != nullptr) {
+			// a failed load has already deleted the stream
+			if (!smush->video->loadStreaming(push))
+				smush->push = nullptr;
+		} else
+			smush->video->load(stream);
 
 		smush->gfx = new GraphicsManager();
 		smush->gfx->init(smush->video->getWidth(), smush->video->getHeight(), smush->video->isHighColor());
@@ -69,6 +78,72 @@ extern "C"
 		return smush;
 	}
 
+	SMUSH* __cdecl smushLoad(void* pBuffer, int len)
+	{
+		return createSmush(createReadStream(pBuffer, len, true));
+	}
+
+	// like smushLoad but reads pBuffer in place instead of copying it. the host keeps ownership and
+	// must leave the buffer allocated and unmodified until smushDestroy returns for this handle
+	SMUSH* __cdecl smushLoadBorrowed(void* pBuffer, int len)
+	{
+		return createSmush(createReadStream(pBuffer, len, false));
+	}
+
+	// resolves szFileName through smith's resource system and maps the file instead of reading it all
+	// up front. returns null if the file can't be found or opened
+	SMUSH* __cdecl smushLoadFile(const char* szFileName)
+	{
+		if (smith == nullptr || smith->LocateDiskFile == nullptr || szFileName == nullptr)
+			return nullptr;
+
+		char szFullPath[MAX_PATH];
+		if (!smith->LocateDiskFile(szFileName, szFullPath))
+			return nullptr;
+
+		SeekableReadStream* stream = createMappedReadStream(szFullPath);
+		if (stream == nullptr)
+			stream = createReadStream(szFullPath);
+		if (stream == nullptr)
+			return nullptr;
+
+		return createSmush(stream);
+	}
+
+	// starts playback before the whole file is in memory. pBuffer must hold at least the header (and the
+	// first frames for old ANIM files); the rest follows through smushAppendData. at most windowBytes of
+	// not-yet-demuxed data are held (0 = 8MB), which must be more than the largest frame
+	SMUSH* __cdecl smushLoadStreaming(void* pBuffer, int len, int windowBytes)
+	{
+		if (windowBytes <= 0)
+			windowBytes = 8 * 1024 * 1024;
+
+		PushReadStream* push = new PushReadStream((uint32)windowBytes);
+		if (pBuffer != nullptr && len > 0)
+			push->append(pBuffer, (uint32)len);
+
+		return createSmush(push, push);
+	}
+
+	// returns how many bytes were taken; fewer than len means the window is full, so pass the rest
+	// again after a few more frames have played. the data is copied, so pBuffer can be reused
+	int __cdecl smushAppendData(SMUSH* smush, void* pBuffer, int len)
+	{
+		if (smush == nullptr || smush->push == nullptr || pBuffer == nullptr || len <= 0)
+			return 0;
+
+		return (int)smush->push->append(pBuffer, (uint32)len);
+	}
+
+	// no more data is coming. a file cut short ends playback instead of waiting forever
+	void __cdecl smushFinishData(SMUSH* smush)
+	{
+		if (smush == nullptr || smush->push == nullptr)
+			return;
+
+		smush->push->finish();
+	}
+
 	void __cdecl smushGetInfo(SMUSH* smush, int& width, int& height, int& numframes, double& fps)
 	{
 		if (smush == nullptr)
@@ -80,6 +155,7 @@ extern "C"
 		fps = smush->video->getFPS();
 	}
 
+	// 0 = nothing new to show (not time yet, or the frame came out identical), 1 = new frame, 2 = done
 	int __cdecl smushFrame(SMUSH* smush)
 	{
 		if (smush == nullptr)
@@ -96,6 +172,85 @@ extern "C"
 		smush->gfx->toBitmap(scan0, stride);
 	}
 
+	// like smushGetFrame but only rewrites what changed since the last smushGetFrame/smushGetFrameDirty.
+	// scan0 must still hold that previous frame.
+	void __cdecl smushGetFrameDirty(SMUSH* smush, void* scan0, int stride)
+	{
+		if (smush == nullptr)
+			return;
+
+		smush->gfx->toBitmap(scan0, stride, true);
+	}
+
+	// sets what smushGetFrame/smushGetFrameDirty write: 0 = 24-bit BGR (the default), 1 = 32-bit BGRA,
+	// 2 = 16-bit RGB565, 3 = 8-bit palette indices (fetch the colours with smushGetPalette).
+	// the next frame should be fetched whole. returns the bytes per pixel in use
+	int __cdecl smushSetPixelFormat(SMUSH* smush, int format)
+	{
+		if (smush == nullptr)
+			return 0;
+
+		smush->gfx->setPixelFormat((GraphicsManager::PixelFormat)format);
+		return smush->gfx->getBytesPerPixel();
+	}
+
+	// scales what smushGetFrame writes so the host can use it as is. filter 0 = off, 1 = nearest, 2 = bilinear
+	// (nearest for 8-bit output). aspect 1 fits a 4:3 picture inside and fills the rest black, e.g. 320x200
+	// at 320x240. width/height are the size wanted (0 = the frame's width, at 4:3 with aspect) and come back
+	// as the size scan0 has to be. dirty rects are in output pixels. the next frame should be fetched whole
+	void __cdecl smushSetScaling(SMUSH* smush, int filter, int aspect, int& width, int& height)
+	{
+		if (smush == nullptr)
+			return;
+
+		smush->gfx->setScaling((GraphicsManager::ScaleFilter)filter, aspect != 0, width, height);
+		width = smush->gfx->getOutputWidth();
+		height = smush->gfx->getOutputHeight();
+	}
+
+	// copies the current palette as 256 RGB triplets (768 bytes) into buffer. returns 1 if it changed
+	// since the last call, so indexed hosts only re-upload it when they have to
+	int __cdecl smushGetPalette(SMUSH* smush, void* buffer)
+	{
+		if (smush == nullptr || buffer == nullptr)
+			return 0;
+
+		return smush->gfx->getPalette((byte*)buffer) ? 1 : 0;
+	}
+
+	// bytes smushGetFrameMips needs for levels mip levels (0 = down to 1x1) at the current output size and
+	// pixel format. 0 if the format can't be mipmapped (only 24 and 32-bit can)
+	int __cdecl smushGetMipChainSize(SMUSH* smush, int levels)
+	{
+		if (smush == nullptr)
+			return 0;
+
+		return smush->gfx->getMipChainSize(levels);
+	}
+
+	// like smushGetFrame (or smushGetFrameDirty with dirtyOnly 1) but follows the frame with its mip levels,
+	// each half the size of the one before (at least 1 pixel) with rows packed tightly, ready to upload.
+	// dirtyOnly only redoes what changed on each level, so buffer must still hold the previous chain.
+	// returns the levels written, 0 if the pixel format can't be mipmapped
+	int __cdecl smushGetFrameMips(SMUSH* smush, void* buffer, int levels, int dirtyOnly)
+	{
+		if (smush == nullptr || buffer == nullptr)
+			return 0;
+
+		return smush->gfx->toMipChain(buffer, levels, dirtyOnly != 0);
+	}
+
+	// fills rects with x,y,w,h quads covering what changed since the last smushGetFrame/smushGetFrameDirty
+	// so the host only has to upload those. returns how many; if there are more than maxRects you get
+	// a single rect around all of them.  call it before getting the frame, which resets it.
+	int __cdecl smushGetDirtyRects(SMUSH* smush, int* rects, int maxRects)
+	{
+		if (smush == nullptr)
+			return 0;
+
+		return smush->gfx->getDirtyRects(rects, maxRects);
+	}
+
 	void __cdecl smushGetAudio(SMUSH* smush, void* buffer, int len)
 	{
 		if (smush == nullptr)
@@ -104,11 +259,85 @@ extern "C"
 		smush->audio->callbackHandler((byte*)buffer, len);
 	}
 
+	// sets what smushGetAudio delivers: rate in hz (0 = the cutscene's own rate, so nothing gets resampled),
+	// 1 or 2 channels, and format 0 = 16-bit or 1 = float. only works before the first smushFrame.
+	// returns the rate smushGetAudio will use.  without it you get stereo 16-bit 44100hz.
+	int __cdecl smushSetAudioFormat(SMUSH* smush, int rate, int channels, int format)
+	{
+		if (smush == nullptr)
+			return 0;
+
+		return smush->audio->setOutputFormat(rate, channels, (AudioManager::SampleFormat)format, smush->video->getAudioRate());
+	}
+
 	int __cdecl smushGetCutsceneStringId(SMUSH* smush)
 	{
 		return smush->video->getCutsceneStringId();
 	}
 
+	// forces the pixel/audio kernels down to a specific CPUTier (0 scalar, 1 sse2, 2 ssse3, 3 avx2, 4 avx512, 5 neon)
+	// for benchmarking and output verification. tiers the cpu cant run are lowered.
+	// returns the tier actually in use.  the SMUSH_CPU_TIER env var does the same at InitializePlugin.
+	int __cdecl smushSetCPUTier(int tier)
+	{
+		return bindKernels((CPUTier)tier);
+	}
+
+	// returns the CPUTier the kernels are currently bound to
+	int __cdecl smushGetCPUTier()
+	{
+		return getKernelTier();
+	}
+
+	// how many threads codec48 frames get split across. 0 (the default) uses one per core,
+	// 1 decodes on the calling thread only. small frames use fewer than asked.
+	void __cdecl smushSetDecodeThreads(SMUSH* smush, int threads)
+	{
+		if (smush == nullptr)
+			return;
+
+		smush->video->setDecodeThreads(threads);
+	}
+
+	// decodes up to frames ahead on a background thread so smushFrame never decodes inline,
+	// keeping the decoded frames under maxMegabytes. 0 frames (the default) decodes inline.
+	// only works before the first smushFrame. returns how many frames ahead it will decode.
+	int __cdecl smushSetDecodeAhead(SMUSH* smush, int frames, int maxMegabytes)
+	{
+		if (smush == nullptr)
+			return 0;
+
+		return smush->video->setDecodeAhead(frames, maxMegabytes);
+	}
+
+	// keeps decoder snapshots every interval frames within maxMegabytes so seeking only decodes from the nearest
+	// one (defaults 32 frames, 16MB). interval 0 seeks by decoding from the start. call before the first smushFrame
+	void __cdecl smushSetSeekSnapshots(SMUSH* smush, int interval, int maxMegabytes)
+	{
+		if (smush == nullptr)
+			return;
+
+		smush->video->setSeekSnapshots(interval, maxMegabytes);
+	}
+
+	// continues playback at the given frame, which the next smushFrame shows. returns the frame landed on,
+	// or -1 if the video can't seek (streamed loads)
+	int __cdecl smushSeek(SMUSH* smush, int frame)
+	{
+		if (smush == nullptr)
+			return -1;
+
+		return smush->video->seek(*smush->gfx, frame < 0 ? 0 : frame);
+	}
+
+	int __cdecl smushSeekTime(SMUSH* smush, int ms)
+	{
+		if (smush == nullptr)
+			return -1;
+
+		return smush->video->seek(*smush->gfx, smush->video->getFrameAtTime(ms < 0 ? 0 : ms));
+	}
+
 	void __cdecl smushDestroy(SMUSH* smush)
 	{
 		if (smush == nullptr)
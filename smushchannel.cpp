@@ -25,15 +25,16 @@
 #include <assert.h>
 #include "audiostream.h"
 #include "smushchannel.h"
+#include "util.h"
 
 SMUSHChannel::SMUSHChannel(AudioManager *audio, uint track, uint maxFrames) {
 	_audio = audio;
 	_track = track;
 	_maxFrames = maxFrames;
 	_stream = 0;
-	_data = 0;
-	_dataSize = 0;
-	_dataConsumed = 0;
+	_ring = 0;
+	_ringSize = 0;
+	_ringRead = _ringWrite = 0;
 	_totalDataUsed = 0;
 	_totalDataSize = 0;
 	_index = -1;
@@ -41,6 +42,7 @@ SMUSHChannel::SMUSHChannel(AudioManager *audio, uint track, uint maxFrames) {
 
 SMUSHChannel::~SMUSHChannel() {
 	_audio->stop(_handle);
+	delete[] _ring;
 }
 
 void SMUSHChannel::setVolume(uint volume) {
@@ -57,33 +59,76 @@ void SMUSHChannel::appendData(uint index, byte *data, uint32 size) {
 
 	_index = index;
 
-	if (_dataConsumed == _dataSize) {
-		delete[] _data;
-		_data = data;
-		_dataSize = size;
-		_dataConsumed = 0;
-	} else {
-		uint32 dataLeft = _dataSize - _dataConsumed;
-		uint32 newSize = dataLeft + size;
-		byte *newData = new byte[newSize];
-		memcpy(newData, _data + _dataConsumed, dataLeft);
-		delete[] _data;
-		memcpy(newData + dataLeft, data, size);
-		delete[] data;
-		_data = newData;
-		_dataSize = newSize;
-		_dataConsumed = 0;
-	}
+	if (getDataAvailable() + size > _ringSize)
+		growRing(getDataAvailable() + size);
+
+	// Copy in up to the end of the ring, then the rest at the start
+	uint32 offset = _ringWrite & (_ringSize - 1);
+	uint32 firstPart = MIN<uint32>(size, _ringSize - offset);
+	memcpy(_ring + offset, data, firstPart);
+	memcpy(_ring, data + firstPart, size - firstPart);
+	_ringWrite += size;
+	delete[] data;
 
 	update();
 }
 
+void SMUSHChannel::growRing(uint32 size) {
+	uint32 newSize = MAX<uint32>(_ringSize, 4096);
+	while (newSize < size)
+		newSize <<= 1;
+
+	// Unwrap what's there into the start of the new ring
+	byte *newRing = new byte[newSize];
+	uint32 used = getDataAvailable();
+	readData(newRing, used);
+
+	delete[] _ring;
+	_ring = newRing;
+	_ringSize = newSize;
+	_ringRead = 0;
+	_ringWrite = used;
+}
+
+const byte *SMUSHChannel::peekData(uint32 &size) const {
+	uint32 offset = _ringRead & (_ringSize - 1);
+	size = MIN<uint32>(getDataAvailable(), _ringSize - offset);
+	return _ring + offset;
+}
+
+void SMUSHChannel::consumeData(uint32 size) {
+	assert(size <= getDataAvailable());
+	_ringRead += size;
+}
+
+bool SMUSHChannel::readData(byte *dst, uint32 size) {
+	if (size > getDataAvailable())
+		return false;
+
+	while (size > 0) {
+		uint32 spanSize;
+		const byte *span = peekData(spanSize);
+		spanSize = MIN(spanSize, size);
+
+		memcpy(dst, span, spanSize);
+		consumeData(spanSize);
+		dst += spanSize;
+		size -= spanSize;
+	}
+
+	return true;
+}
+
 bool SMUSHChannel::done() const {
 	return _stream && _totalDataUsed >= _totalDataSize;
 }
 
 void SMUSHChannel::startStream() {
 	assert(_stream);
-	_audio->play(_stream, _handle, _volume, _balance);
+
+	if (!_audio->play(_stream, _handle, _volume, _balance)) {
+		delete _stream;
+		_stream = 0;
+	}
 }
 
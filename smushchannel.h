@@ -45,9 +45,19 @@ protected:
 	byte _volume;
 	int8 _balance;
 
-	byte *_data;
-	uint32 _dataSize, _dataConsumed;
 	uint32 _totalDataUsed, _totalDataSize;
+
+	/**
+	 * The data appended so far and not consumed yet, as a ring. Returns the
+	 * next contiguous span of it; size is 0 when there is none. The rest of
+	 * the data (past the wrap) comes with the next call after consuming.
+	 */
+	const byte *peekData(uint32 &size) const;
+	void consumeData(uint32 size);
+	uint32 getDataAvailable() const { return _ringWrite - _ringRead; }
+
+	/** Copy size bytes out and consume them, e.g. a header split by the wrap. */
+	bool readData(byte *dst, uint32 size);
 	int _index;
 
 	AudioManager *_audio;
@@ -58,6 +68,11 @@ protected:
 
 private:
 	AudioHandle _handle;
+
+	byte *_ring;
+	uint32 _ringSize; // power of two, so the positions can wrap around freely
+	uint32 _ringRead, _ringWrite;
+	void growRing(uint32 size);
 };
 
 #endif
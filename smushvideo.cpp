@@ -57,28 +57,54 @@
 
 SMUSHVideo::SMUSHVideo(AudioManager &audio) : _audio(&audio) {
 	cutscene_string_id = 0;
+	_shownStringId = 0;
 	curFrame = 0;
 	lastFrameTick = 0;
 	_file = 0;
+	_pushStream = 0;
+	_indexEnd = 0;
 	_buffer = _storedFrame = 0;
+	_frame = 0;
 	_storeFrame = false;
 	_codec48 = 0;
+	_decodeThreads = 0;
+	_shownCodec48 = false;
 	_runSoundHeaderCheck = false;
 	_ranIACTSoundCheck = false;
 	_audioChannels = 0;
 	_width = _height = 0;
 	_iactStream = 0;
+	_iactRingFull = false;
 	_iactBuffer = 0;
+	_iactPos = 0;
 	_frameRate = 0;
 	_audioRate = 0;
+	_aheadSlots = 0;
+	_aheadDepth = 0;
+	_aheadRead = _aheadWrite = 0;
+	_aheadThread = _aheadWake = 0;
+	_aheadQuit = false;
+	_aheadGfx = 0;
+	_aheadStart = 0;
+	_demuxedFrames = 0;
+	_demuxAhead = 1;
+	_snapshotInterval = 32;
+	_snapshotBudget = 16 * 1024 * 1024;
+	_snapshotBytes = 0;
+	_audioFromFrame = 0;
 }
 
 SMUSHVideo::~SMUSHVideo() {
 	close();
 }
 
-bool SMUSHVideo::load(void* buf, int len) {
-	_file = wrapCompressedReadStream(createReadStream(buf, len));
+bool SMUSHVideo::loadStreaming(PushReadStream *stream) {
+	_pushStream = stream;
+	return load(stream);
+}
+
+bool SMUSHVideo::load(SeekableReadStream *stream) {
+	_file = wrapCompressedReadStream(stream);
 
 	if (!_file)
 		return false;
@@ -102,6 +128,12 @@ bool SMUSHVideo::load(void* buf, int len) {
 		return false;
 	}
 
+	// Demux enough frames ahead to cover about half a second of audio
+	_demuxAhead = 1;
+	if (_frameRate != 0)
+		while (_demuxAhead < 64 && getNextFrameTime(_demuxAhead) < 500)
+			_demuxAhead++;
+
 	/*printf("'%s' Details:\n", fileName);
 	printf("\tSMUSH Tag: '%c%c%c%c'\n", LISTTAG(_mainTag));
 	printf("\tFrame Count: %d\n", _frameCount);
@@ -125,25 +157,38 @@ bool SMUSHVideo::load(void* buf, int len) {
 }
 
 void SMUSHVideo::close() {
+	stopDecodeAhead();
 	_audio->stopAll();
+	clearPackets();
 
 	if (_file) {
 		delete _file;
 		_file = 0;
+		_pushStream = 0;
 
 		delete[] _buffer;
 		_buffer = 0;
+		_frame = 0;
 
 		delete[] _storedFrame;
 		_storedFrame = 0;
 
+		_frameIndex.clear();
+		_chunkIndex.clear();
+		_indexEnd = 0;
+
 		delete _codec48;
 		_codec48 = 0;
+		_shownCodec48 = false;
 
 		_iactStream = 0;
 
 		delete[] _iactBuffer;
 		_iactBuffer = 0;
+		_iactPos = 0;
+
+		clearSnapshots();
+		_audioFromFrame = 0;
 
 		_runSoundHeaderCheck = false;
 		_ranIACTSoundCheck = false;
@@ -180,6 +225,118 @@ double SMUSHVideo::getFPS() const {
 	return (double)_frameRate;
 }
 
+uint SMUSHVideo::getAudioRate() const {
+	// SANM says in its header. Otherwise it's IACT, which is always 22050Hz
+	// whatever the ANIM header claims (see bufferIACTAudio()).
+	if (isHighColor() && _audioRate != 0)
+		return _audioRate;
+
+	return 22050;
+}
+
+void SMUSHVideo::setDecodeThreads(int threads) {
+	_decodeThreads = threads;
+
+	// The decode-ahead worker owns the decoder once it's running
+	if (_codec48 && !_aheadThread)
+		_codec48->setThreadCount(threads);
+}
+
+int SMUSHVideo::setDecodeAhead(int frames, int maxMegabytes) {
+	if (_aheadThread || lastFrameTick != 0)
+		return _aheadDepth;
+
+	// A slot keeps the 8bpp frame and its map of dirty 8x8 blocks
+	double frameSize = (double)_pitch * _height + ((_width + 7) / 8) * ((_height + 7) / 8);
+
+	if (frames > 0 && frameSize > 0)
+		_aheadDepth = (int)MIN<double>(frames, maxMegabytes * 1024.0 * 1024.0 / frameSize);
+	else
+		_aheadDepth = 0;
+
+	return _aheadDepth;
+}
+
+void SMUSHVideo::startDecodeAhead() {
+	_aheadSlots = new AheadSlot[_aheadDepth];
+
+	for (int i = 0; i < _aheadDepth; i++) {
+		_aheadSlots[i].gfx = new GraphicsManager();
+		_aheadSlots[i].gfx->init(_width, _height, isHighColor());
+		_aheadSlots[i].stringId = 0;
+	}
+
+	_aheadGfx = new GraphicsManager();
+	_aheadGfx->init(_width, _height, isHighColor());
+
+	_aheadRead = _aheadWrite = 0;
+	_aheadStart = curFrame;
+	_aheadQuit = false;
+	_aheadWake = CreateEvent(0, FALSE, FALSE, 0);
+	_aheadThread = CreateThread(0, 0, decodeAheadProc, this, 0, 0);
+}
+
+void SMUSHVideo::stopDecodeAhead() {
+	if (!_aheadThread)
+		return;
+
+	_aheadQuit = true;
+	SetEvent(_aheadWake);
+	WaitForSingleObject(_aheadThread, INFINITE);
+	CloseHandle(_aheadThread);
+	CloseHandle(_aheadWake);
+	_aheadThread = _aheadWake = 0;
+
+	for (int i = 0; i < _aheadDepth; i++)
+		delete _aheadSlots[i].gfx;
+
+	delete[] _aheadSlots;
+	_aheadSlots = 0;
+
+	delete _aheadGfx;
+	_aheadGfx = 0;
+}
+
+DWORD WINAPI SMUSHVideo::decodeAheadProc(LPVOID param) {
+	((SMUSHVideo *)param)->decodeAhead();
+	return 0;
+}
+
+void SMUSHVideo::decodeAhead() {
+	// Frames are drawn into our own manager, which keeps the palette and
+	// the previous frame for the next one, and then copied into the ring
+	if (!isHighColor())
+		_aheadGfx->setPalette(_palette, 0, 256);
+
+	uint frame = _aheadStart;
+
+	while (frame < _frameCount && !_aheadQuit) {
+		if (_aheadWrite - _aheadRead == _aheadDepth) {
+			// Ring is full; frame() signals after taking one out
+			WaitForSingleObject(_aheadWake, INFINITE);
+			continue;
+		}
+
+		if (isStarved()) {
+			// Poll until the host has appended the next frame
+			WaitForSingleObject(_aheadWake, 10);
+			continue;
+		}
+
+		MemoryBarrier();
+		AheadSlot &slot = _aheadSlots[_aheadWrite % _aheadDepth];
+
+		handleFrame(*_aheadGfx);
+		_aheadGfx->update();
+
+		slot.gfx->takeFrame(*_aheadGfx, false);
+		slot.stringId = cutscene_string_id;
+
+		InterlockedIncrement(&_aheadWrite);
+		frame++;
+	}
+}
+
 uint32 SMUSHVideo::getNextFrameTime(uint32 curFrame) const {
 	// SANM stores the frame rate as time between frames
 	if (_mainTag == MKTAG('S', 'A', 'N', 'M'))
@@ -202,7 +359,14 @@ int SMUSHVideo::frame(GraphicsManager &gfx)
 		if (!isHighColor())
 			gfx.setPalette(_palette, 0, 256);
 
-		lastFrameTick = GetTicks();
+		// Counted back from curFrame in case seek() moved it
+		lastFrameTick = GetTicks() - getNextFrameTime(curFrame);
+
+		// The worker decodes into the buffers gfx may still be showing
+		if (_aheadDepth > 0) {
+			gfx.detach();
+			startDecodeAhead();
+		}
 	}
 
 	if(curFrame >= _frameCount)
@@ -215,13 +379,285 @@ int SMUSHVideo::frame(GraphicsManager &gfx)
 #endif
 
 	//lastFrameTick = tick;
-	handleFrame(gfx);
+	int stringId = _shownStringId;
+
+	if (_aheadThread) {
+		// Never decode here. If the worker fell behind, try again next call.
+		if (_aheadRead == _aheadWrite) {
+			// A streamed video waiting on data pauses rather than rushing to catch up
+			if (_pushStream)
+				lastFrameTick = tick - getNextFrameTime(curFrame);
+
+			return 0/*no new frame*/;
+		}
+
+		MemoryBarrier();
+		AheadSlot &slot = _aheadSlots[_aheadRead % _aheadDepth];
+		gfx.takeFrame(*slot.gfx, true);
+		_shownStringId = slot.stringId;
+
+		InterlockedIncrement(&_aheadRead);
+		SetEvent(_aheadWake);
+	} else {
+		if (isStarved()) {
+			lastFrameTick = tick - getNextFrameTime(curFrame);
+			return 0/*no new frame*/;
+		}
+
+		handleFrame(gfx);
+		_shownStringId = cutscene_string_id;
+	}
+
 	gfx.update();
 	curFrame++;
 
+	// Nothing to show if the frame came out the same (common on static shots)
+	if (!gfx.isDirty() && _shownStringId == stringId)
+		return 0/*no new frame*/;
+
 	return 1/*new frame*/;
 }
 
+void SMUSHVideo::setSeekSnapshots(int interval, int maxMegabytes) {
+	if (_aheadThread || lastFrameTick != 0)
+		return;
+
+	_snapshotInterval = MAX(interval, 0);
+	_snapshotBudget = (uint32)MIN<double>(MAX(maxMegabytes, 0) * 1024.0 * 1024.0, 0x7FFFFFFF);
+}
+
+int SMUSHVideo::seek(GraphicsManager &gfx, uint frame) {
+	// A streamed file has already let go of what was played
+	if (!isLoaded() || _pushStream || _frameCount == 0)
+		return -1;
+
+	bool ahead = _aheadThread != 0;
+	stopDecodeAhead();
+
+	// Frames are indexed as the demuxer reaches them, so a seek forward
+	// has to index up to its target first
+	while (_frameIndex.size() <= frame && _frameIndex.size() < _frameCount && indexFrame())
+		;
+
+	if (_frameIndex.empty()) {
+		if (ahead && lastFrameTick != 0) {
+			gfx.detach();
+			startDecodeAhead();
+		}
+
+		return -1;
+	}
+
+	if (frame >= _frameIndex.size())
+		frame = _frameIndex.size() - 1;
+
+	// Drop everything demuxed or queued for the old position
+	_audio->stopAll();
+	_iactStream = 0;
+	clearPackets();
+
+	for (ChannelMap::iterator it = _audioTracks.begin(); it != _audioTracks.end(); it++)
+		delete it->second;
+
+	_audioTracks.clear();
+
+	// Without a snapshot nothing has been decoded, so we're still at the start
+	uint start = 0;
+	SnapshotMap::iterator it = _snapshots.upper_bound(frame);
+
+	if (it != _snapshots.begin()) {
+		--it;
+		start = it->first;
+		restoreSnapshot(gfx, *it->second);
+	}
+
+	_demuxedFrames = start;
+	_audioFromFrame = frame;
+
+	for (uint i = start; i < frame; i++)
+		handleFrame(gfx);
+
+	gfx.update();
+	curFrame = frame;
+	_shownStringId = cutscene_string_id;
+
+	// Otherwise the first frame() call sets all this up
+	if (lastFrameTick != 0) {
+		lastFrameTick = GetTicks() - getNextFrameTime(frame);
+
+		if (ahead) {
+			gfx.detach();
+			startDecodeAhead();
+		}
+	}
+
+	return frame;
+}
+
+uint SMUSHVideo::getFrameAtTime(uint32 time) const {
+	if (_frameRate == 0)
+		return 0;
+
+	// The inverse of getNextFrameTime()
+	if (_mainTag == MKTAG('S', 'A', 'N', 'M'))
+		return (uint)(time * 1000.0 / _frameRate);
+
+	return (uint)((double)time * _frameRate / 1000);
+}
+
+bool SMUSHVideo::isSnapshotFrame(uint frame) const {
+	if (frame != 0 && (_snapshotInterval == 0 || frame % _snapshotInterval != 0))
+		return false;
+
+	return _snapshots.find(frame) == _snapshots.end();
+}
+
+void SMUSHVideo::takeSnapshot(uint frame) {
+	// Pair up with the IACT parser state demuxFrame() recorded
+	while (!_pendingIACT.empty() && _pendingIACT.front().frame < frame) {
+		delete[] _pendingIACT.front().buffer;
+		_pendingIACT.pop_front();
+	}
+
+	if (_pendingIACT.empty() || _pendingIACT.front().frame != frame)
+		return;
+
+	IACTState iact = _pendingIACT.front();
+	_pendingIACT.pop_front();
+
+	bool frameIsCodec48 = _codec48 && _frame == _codec48->getOutput();
+	uint32 frameSize = _pitch * _height;
+	uint32 bytes = sizeof(Snapshot) + iact.pos;
+
+	if (_buffer && !frameIsCodec48)
+		bytes += frameSize;
+	if (_storedFrame)
+		bytes += frameSize;
+	if (_codec48)
+		bytes += _codec48->getStateSize();
+
+	// Over budget, thin out what we have to cover the video more coarsely
+	while (_snapshots.size() > 1 && _snapshotBytes + bytes > _snapshotBudget) {
+		_snapshotInterval *= 2;
+
+		for (SnapshotMap::iterator it = _snapshots.begin(); it != _snapshots.end();) {
+			if (it->first % _snapshotInterval != 0) {
+				freeSnapshot(it->second);
+				_snapshots.erase(it++);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	// The start is always kept, since there's nothing to decode from before it
+	if (frame != 0 && (frame % _snapshotInterval != 0 || _snapshotBytes + bytes > _snapshotBudget)) {
+		delete[] iact.buffer;
+		return;
+	}
+
+	Snapshot *snapshot = new Snapshot();
+	memcpy(snapshot->palette, _palette, sizeof(_palette));
+	memcpy(snapshot->deltaPalette, _deltaPalette, sizeof(_deltaPalette));
+
+	snapshot->buffer = 0;
+	if (_buffer && !frameIsCodec48) {
+		snapshot->buffer = new byte[frameSize];
+		memcpy(snapshot->buffer, _buffer, frameSize);
+	}
+
+	snapshot->storedFrame = 0;
+	if (_storedFrame) {
+		snapshot->storedFrame = new byte[frameSize];
+		memcpy(snapshot->storedFrame, _storedFrame, frameSize);
+	}
+
+	snapshot->codec48 = 0;
+	if (_codec48) {
+		snapshot->codec48 = new Codec48Decoder::State();
+		_codec48->saveState(*snapshot->codec48);
+	}
+
+	snapshot->storeFrame = _storeFrame;
+	snapshot->frameIsCodec48 = frameIsCodec48;
+	snapshot->stringId = cutscene_string_id;
+	snapshot->iact = iact;
+	snapshot->bytes = bytes;
+
+	_snapshots[frame] = snapshot;
+	_snapshotBytes += bytes;
+}
+
+void SMUSHVideo::restoreSnapshot(GraphicsManager &gfx, const Snapshot &snapshot) {
+	memcpy(_palette, snapshot.palette, sizeof(_palette));
+	memcpy(_deltaPalette, snapshot.deltaPalette, sizeof(_deltaPalette));
+
+	uint32 frameSize = _pitch * _height;
+
+	if (snapshot.buffer)
+		memcpy(_buffer, snapshot.buffer, frameSize);
+
+	if (snapshot.storedFrame) {
+		if (!_storedFrame)
+			_storedFrame = new byte[frameSize];
+
+		memcpy(_storedFrame, snapshot.storedFrame, frameSize);
+	} else {
+		delete[] _storedFrame;
+		_storedFrame = 0;
+	}
+
+	if (snapshot.codec48) {
+		// An earlier restore may have dropped the decoder
+		if (!_codec48) {
+			_codec48 = new Codec48Decoder(_width, _height);
+			_codec48->setThreadCount(_decodeThreads);
+		}
+
+		_codec48->restoreState(*snapshot.codec48);
+	} else {
+		// Taken before the first codec48 frame; it's made again there
+		delete _codec48;
+		_codec48 = 0;
+	}
+
+	_frame = snapshot.frameIsCodec48 ? _codec48->getOutput() : _buffer;
+	_shownCodec48 = false;
+	_storeFrame = snapshot.storeFrame;
+	cutscene_string_id = snapshot.stringId;
+
+	_iactPos = snapshot.iact.pos;
+	if (_iactPos > 0) {
+		if (!_iactBuffer)
+			_iactBuffer = new byte[4096];
+
+		memcpy(_iactBuffer, snapshot.iact.buffer, _iactPos);
+	}
+
+	if (!isHighColor())
+		gfx.setPalette(_palette, 0, 256);
+
+	if (_frame)
+		gfx.blit(_frame, 0, 0, _width, _height, _pitch, 0);
+}
+
+void SMUSHVideo::freeSnapshot(Snapshot *snapshot) {
+	_snapshotBytes -= snapshot->bytes;
+
+	delete[] snapshot->buffer;
+	delete[] snapshot->storedFrame;
+	delete snapshot->codec48;
+	delete[] snapshot->iact.buffer;
+	delete snapshot;
+}
+
+void SMUSHVideo::clearSnapshots() {
+	for (SnapshotMap::iterator it = _snapshots.begin(); it != _snapshots.end(); it++)
+		freeSnapshot(it->second);
+
+	_snapshots.clear();
+}
+
 void SMUSHVideo::play(GraphicsManager &gfx) {
 	if (!isLoaded())
 		return;
@@ -290,6 +726,7 @@ bool SMUSHVideo::readHeader() {
 		}
 
 		_file->seek(pos + size + (size & 1), SEEK_SET);
+		buildIndex(kFrameSizeProbeFrames);
 		return detectFrameSize();
 	} else if (tag == MKTAG('S', 'H', 'D', 'R')) {
 		_file->readUint16LE();
@@ -302,14 +739,35 @@ bool SMUSHVideo::readHeader() {
 		_frameRate = _file->readUint32LE();
 		/* _flags = */ _file->readUint16LE();
 		_file->seek(pos + size + (size & 1), SEEK_SET);
-		return readFrameHeader();
+
+		if (!readFrameHeader())
+			return false;
+
+		buildIndex(0);
+		return true;
 	}
 
 	fprintf(stderr, "Unknown SMUSH header type '%c%c%c%c'\n", LISTTAG(tag));
 	return false;
 }
 
-bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
+void SMUSHVideo::buildIndex(uint frames) {
+	_frameIndex.clear();
+	_chunkIndex.clear();
+	_indexEnd = _file->pos();
+
+	// Only what the header needs is indexed up front. demuxFrame() indexes
+	// the rest as it gets there, so loading doesn't touch the whole file
+	// (and a streamed one doesn't have it yet).
+	frames = MIN(frames, _frameCount);
+
+	while (_frameIndex.size() < frames && hasUnindexedFrame() && indexFrame())
+		;
+}
+
+bool SMUSHVideo::indexFrame() {
+	_file->seek(_indexEnd, SEEK_SET);
+
 	uint32 tag = _file->readUint32BE();
 	uint32 size = _file->readUint32BE();
 	uint32 pos = _file->pos();
@@ -324,63 +782,233 @@ bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
 	}
 
 	// Now we have to be at FRME
-	if (tag != MKTAG('F', 'R', 'M', 'E'))
+	if (tag != MKTAG('F', 'R', 'M', 'E') || _file->eos())
 		return false;
 
-	uint32 bytesLeft = size;
-	while (bytesLeft > 0) {
-		uint32 subType = _file->readUint32BE();
-		uint32 subSize = _file->readUint32BE();
-		uint32 subPos = _file->pos();
+	FrameEntry entry;
+	entry.offset = pos;
+	entry.size = size;
+	entry.firstChunk = _chunkIndex.size();
+	entry.chunkCount = 0;
+	entry.truncated = false;
+
+	uint32 subPos = 0;
+
+	while (subPos < size) {
+		if (size - subPos < 8) {
+			entry.truncated = true;
+			break;
+		}
+
+		_file->seek(pos + subPos, SEEK_SET);
+
+		ChunkEntry chunk;
+		chunk.tag = _file->readUint32BE();
+		chunk.size = _file->readUint32BE();
+		chunk.offset = subPos + 8;
 
 		if (_file->eos()) {
-			// HACK: L2PLAY.ANM from Rebel Assault seems to have an unaligned FOBJ :/
+			entry.truncated = true;
+			break;
+		}
+
+		_chunkIndex.push_back(chunk);
+		entry.chunkCount++;
+
+		// A chunk claiming more than the frame holds is the last one
+		if (chunk.size >= size - chunk.offset)
+			break;
+
+		subPos = chunk.offset + chunk.size + (chunk.size & 1);
+	}
+
+	_frameIndex.push_back(entry);
+	_indexEnd = pos + size + (size & 1);
+	return true;
+}
+
+bool SMUSHVideo::hasUnindexedFrame() {
+	if (!_pushStream)
+		return true;
+
+	// Peek at the next chunk headers
+	_file->seek(_indexEnd, SEEK_SET);
+	uint32 end = _indexEnd + 8;
+
+	if (!_pushStream->isAvailable(end))
+		return false;
+
+	uint32 tag = _file->readUint32BE();
+	uint32 size = _file->readUint32BE();
+	end += size + (size & 1);
+
+	if (tag == MKTAG('A', 'N', 'N', 'O')) {
+		if (!_pushStream->isAvailable(end + 8))
+			return false;
+
+		_file->seek(end, SEEK_SET);
+		_file->readUint32BE();
+		size = _file->readUint32BE();
+		end += 8 + size + (size & 1);
+	}
+
+	return _pushStream->isAvailable(end);
+}
+
+bool SMUSHVideo::demuxFrame() {
+	if (_demuxedFrames == _frameIndex.size() && !indexFrame())
+		return false;
+
+	const FrameEntry &entry = _frameIndex[_demuxedFrames];
+
+	FramePacket packet;
+	packet.frame = _demuxedFrames;
+	packet.data = new byte[entry.size + kPacketPadding];
+	_file->seek(entry.offset, SEEK_SET);
+	packet.size = _file->read(packet.data, entry.size);
+	memset(packet.data + packet.size, 0, entry.size + kPacketPadding - packet.size);
+
+	// A snapshot of this frame needs the IACT parser as it is before the frame
+	if (isSnapshotFrame(packet.frame)) {
+		IACTState iact;
+		iact.frame = packet.frame;
+		iact.pos = _iactPos;
+		iact.buffer = 0;
+
+		if (_iactPos > 0) {
+			iact.buffer = new byte[_iactPos];
+			memcpy(iact.buffer, _iactBuffer, _iactPos);
+		}
+
+		_pendingIACT.push_back(iact);
+	}
+
+	// Queue the audio now so it never waits on the video
+	MemoryReadStream stream(packet.data, packet.size);
+
+	for (uint32 i = 0; i < entry.chunkCount; i++) {
+		const ChunkEntry &chunk = _chunkIndex[entry.firstChunk + i];
+
+		if (chunk.offset > packet.size)
+			break; // handleFrame() complains about it
+
+		if (chunk.tag == MKTAG('I', 'A', 'C', 'T')) {
+			stream.seek(chunk.offset, SEEK_SET);
+			ByteCursor data = stream.getCursor(chunk.size);
+
+			if (!handleIACT(data, chunk.size)) {
+				delete[] packet.data;
+				return false;
+			}
+		}
+	}
+
+	_videoPackets.push_back(packet);
+	_demuxedFrames++;
+
+	// The packet has its own copy, so the stream can let go of the frame
+	if (_pushStream)
+		_pushStream->release(entry.offset + entry.size);
+
+	return true;
+}
+
+bool SMUSHVideo::isFrameAvailable() {
+	return _demuxedFrames < _frameIndex.size() || hasUnindexedFrame();
+}
+
+bool SMUSHVideo::isStarved() {
+	return _pushStream && _videoPackets.empty() && _demuxedFrames < _frameCount && !isFrameAvailable();
+}
+
+void SMUSHVideo::clearPackets() {
+	for (std::deque<FramePacket>::iterator it = _videoPackets.begin(); it != _videoPackets.end(); it++)
+		delete[] it->data;
+
+	_videoPackets.clear();
+	_demuxedFrames = 0;
+
+	for (std::deque<IACTState>::iterator it = _pendingIACT.begin(); it != _pendingIACT.end(); it++)
+		delete[] it->buffer;
+
+	_pendingIACT.clear();
+}
+
+bool SMUSHVideo::handleFrame(GraphicsManager &gfx) {
+	// Keep the demuxer ahead of us so audio is queued well before it's due
+	while (_demuxedFrames < _frameCount && _videoPackets.size() < _demuxAhead && isFrameAvailable()) {
+		if (!demuxFrame()) {
+			_demuxedFrames = _frameCount;
+			break;
+		}
+	}
+
+	if (_videoPackets.empty())
+		return false;
+
+	FramePacket packet = _videoPackets.front();
+	_videoPackets.pop_front();
+
+	if (isSnapshotFrame(packet.frame))
+		takeSnapshot(packet.frame);
+
+	const FrameEntry &entry = _frameIndex[packet.frame];
+	MemoryReadStream stream(packet.data, packet.size, true);
+
+	for (uint32 i = 0; i < entry.chunkCount; i++) {
+		const ChunkEntry &chunk = _chunkIndex[entry.firstChunk + i];
+
+		if (chunk.offset > packet.size) {
 			fprintf(stderr, "Unexpected end of file!\n");
 			return false;
 		}
 
+		stream.seek(chunk.offset, SEEK_SET);
+		ByteCursor data = stream.getCursor(chunk.size);
 		bool result = true;
 
-		switch (subType) {
+		switch (chunk.tag) {
 		case MKTAG('F', 'O', 'B', 'J'):
-			result = handleFrameObject(gfx, subSize);
+			result = handleFrameObject(gfx, data, chunk.size);
 			break;
 		case MKTAG('F', 'T', 'C', 'H'):
-			result = handleFetch(subSize);
+			result = handleFetch(data, chunk.size);
 			break;
 		case MKTAG('I', 'A', 'C', 'T'):
-			result = handleIACT(subSize);
+			// Already queued by demuxFrame()
 			break;
 		case MKTAG('N', 'P', 'A', 'L'):
-			result = handleNewPalette(gfx, subSize);
+			result = handleNewPalette(gfx, data, chunk.size);
 			break;
 		case MKTAG('S', 'T', 'O', 'R'):
-			result = handleStore(subSize);
+			result = handleStore(chunk.size);
 			break;
 		case MKTAG('T', 'E', 'X', 'T'):
 		case MKTAG('T', 'R', 'E', 'S'):
-			result = handleText(subType, subSize);
+			result = handleText(data, chunk.tag, chunk.size);
 			break;
 		case MKTAG('X', 'P', 'A', 'L'):
-			result = handleDeltaPalette(gfx, subSize);
+			result = handleDeltaPalette(gfx, data, chunk.size);
 			break;
 		default:
 			// TODO: Other types
-			printf("\tSub Type: '%c%c%c%c'\n", LISTTAG(subType));
+			printf("\tSub Type: '%c%c%c%c'\n", LISTTAG(chunk.tag));
 		}
 
 		if (!result)
 			return false;
+	}
 
-		bytesLeft -= subSize + 8 + (subSize & 1);
-		_file->seek(subPos + subSize + (subSize & 1), SEEK_SET);
+	if (entry.truncated) {
+		// HACK: L2PLAY.ANM from Rebel Assault seems to have an unaligned FOBJ :/
+		fprintf(stderr, "Unexpected end of file!\n");
+		return false;
 	}
 
-	_file->seek(pos + size + (size & 1), SEEK_SET);
 	return true;
 }
 
-bool SMUSHVideo::handleNewPalette(GraphicsManager &gfx, uint32 size) {
+bool SMUSHVideo::handleNewPalette(GraphicsManager &gfx, ByteCursor &chunk, uint32 size) {
 	// Load a new palette
 
 	if (size < 256 * 3) {
@@ -388,7 +1016,7 @@ bool SMUSHVideo::handleNewPalette(GraphicsManager &gfx, uint32 size) {
 		return false;
 	}
 
-	_file->read(_palette, 256 * 3);
+	chunk.read(_palette, 256 * 3);
 	gfx.setPalette(_palette, 0, 256);
 	return true;
 }
@@ -402,16 +1030,16 @@ static byte deltaColor(byte pal, int16 delta) {
 	return t;
 }
 
-bool SMUSHVideo::handleDeltaPalette(GraphicsManager &gfx, uint32 size) {
+bool SMUSHVideo::handleDeltaPalette(GraphicsManager &gfx, ByteCursor &chunk, uint32 size) {
 	// Decode a delta palette
 
 	if (size == 256 * 3 * 3 + 4) {
-		_file->seek(4, SEEK_CUR);
+		chunk.skip(4);
 
 		for (uint16 i = 0; i < 256 * 3; i++)
-			_deltaPalette[i] = _file->readUint16LE();
+			_deltaPalette[i] = chunk.readUint16LE();
 
-		_file->read(_palette, 256 * 3);
+		chunk.read(_palette, 256 * 3);
 		gfx.setPalette(_palette, 0, 256);
 		return true;
 	} else if (size == 6 || size == 4) {
@@ -422,10 +1050,10 @@ bool SMUSHVideo::handleDeltaPalette(GraphicsManager &gfx, uint32 size) {
 		return true;
 	} else if (size == 256 * 3 * 2 + 4) {
 		// SMUSH v1 only
-		_file->seek(4, SEEK_CUR);
+		chunk.skip(4);
 
 		for (uint16 i = 0; i < 256 * 3; i++)
-			_deltaPalette[i] = _file->readUint16LE();
+			_deltaPalette[i] = chunk.readUint16LE();
 		return true;
 	}
 
@@ -433,11 +1061,7 @@ bool SMUSHVideo::handleDeltaPalette(GraphicsManager &gfx, uint32 size) {
 	return false;
 }
 
-bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, uint32 size) {
-	return handleFrameObject(gfx, _file, size);
-}
-
-bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *stream, uint32 size) {
+bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, ByteCursor &chunk, uint32 size) {
 	// Decode a frame object
 
 	if (isHighColor()) {
@@ -448,14 +1072,16 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 	if (size < 14)
 		return false;
 
-	byte codec = stream->readByte();
-	/* byte codecParam = */ stream->readByte();
-	int16 left = stream->readSint16LE();
-	int16 top = stream->readSint16LE();
-	uint16 width = stream->readUint16LE();
-	uint16 height = stream->readUint16LE();
-	stream->readUint16LE();
-	stream->readUint16LE();
+	const byte *dirtyBlocks = 0;
+
+	byte codec = chunk.readByte();
+	/* byte codecParam = */ chunk.readByte();
+	int16 left = chunk.readSint16LE();
+	int16 top = chunk.readSint16LE();
+	uint16 width = chunk.readUint16LE();
+	uint16 height = chunk.readUint16LE();
+	chunk.readUint16LE();
+	chunk.readUint16LE();
 
 	size -= 14;
 	
@@ -475,19 +1101,35 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 	switch (codec) {
 	case 1:
 	case 3:
-		decodeCodec1(stream, left, top, width, height);
+		decodeCodec1(chunk, left, top, width, height);
 		break;
 	case 48: {
 		// Used by Mysteries of the Sith
 		// Seems similar to codec 47
-		byte *ptr = new byte[size];
-		stream->read(ptr, size);
+		// Decode straight out of the packet unless the chunk is cut short
+		const byte *src = chunk.getData();
+		byte *copy = 0;
+
+		if (chunk.remaining() < size) {
+			copy = new byte[size];
+			memset(copy, 0, size);
+			chunk.read(copy, size);
+			src = copy;
+		}
 
-		if (!_codec48)
+		if (!_codec48) {
 			_codec48 = new Codec48Decoder(width, height);
+			_codec48->setThreadCount(_decodeThreads);
+		}
 
-		_codec48->decode(_buffer, ptr);
-		delete[] ptr;
+		// Show the decoder's buffer directly instead of copying it out
+		_codec48->decode(src);
+		_frame = _codec48->getOutput();
+		delete[] copy;
+
+		// Only redraw what changed if the screen still shows the previous output
+		if (_shownCodec48)
+			dirtyBlocks = _codec48->getDirtyBlocks();
 		} break;
 	default:
 		// TODO: Lots of other Rebel Assault ones
@@ -501,14 +1143,15 @@ bool SMUSHVideo::handleFrameObject(GraphicsManager &gfx, SeekableReadStream *str
 		if (!_storedFrame)
 			_storedFrame = new byte[_pitch * _height];
 
-		memcpy(_storedFrame, _buffer, _pitch * _height);
+		memcpy(_storedFrame, _frame, _pitch * _height);
 		_storeFrame = false;
 	}
 
 	// Ideally, this call should be at the end of the FRME block, but it
 	// seems that breaks things like the video in Rebel Assault of Cmdr.
 	// Farrell coming in to save you.
-	gfx.blit(_buffer, 0, 0, _width, _height, _pitch);
+	gfx.blit(_frame, 0, 0, _width, _height, _pitch, dirtyBlocks);
+	_shownCodec48 = (codec == 48);
 	return true;
 }
 
@@ -521,23 +1164,23 @@ bool SMUSHVideo::handleStore(uint32 size) {
 	return size >= 4;
 }
 
-bool SMUSHVideo::handleText(uint32 type, uint32 size) {
-	int pos_x = _file->readSint16LE();
-	int pos_y = _file->readSint16LE();
-	int flags = _file->readSint16LE();
-	int left = _file->readSint16LE();
-	int top = _file->readSint16LE();
-	int right = _file->readSint16LE();
-	int32 height = _file->readSint16LE();
-	int32 unk2 = _file->readUint16LE();
+bool SMUSHVideo::handleText(ByteCursor &chunk, uint32 type, uint32 size) {
+	int pos_x = chunk.readSint16LE();
+	int pos_y = chunk.readSint16LE();
+	int flags = chunk.readSint16LE();
+	int left = chunk.readSint16LE();
+	int top = chunk.readSint16LE();
+	int right = chunk.readSint16LE();
+	int32 height = chunk.readSint16LE();
+	int32 unk2 = chunk.readUint16LE();
 
 	if(type == MKTAG('T', 'E', 'X', 'T'))
 	{
 		char* sz = new char[size-16];
-		_file->read(sz, size-16);
+		chunk.read(sz, size-16);
 
 	} else {
-		int string_id = _file->readUint16LE();
+		int string_id = chunk.readUint16LE();
 
 		if(string_id != cutscene_string_id)
 		{
@@ -548,7 +1191,7 @@ bool SMUSHVideo::handleText(uint32 type, uint32 size) {
 	return true;
 }
 
-bool SMUSHVideo::handleFetch(uint32 size) {
+bool SMUSHVideo::handleFetch(ByteCursor &chunk, uint32 size) {
 	// Restore an previous frame object
 	int32 xOffset = 0, yOffset = 0;
 
@@ -556,17 +1199,19 @@ bool SMUSHVideo::handleFetch(uint32 size) {
 	// After a STOR, the value is always -1. Then it increases
 	// by 1 each call after that.
 	if (size >= 4)
-		/* int32 u0 = */ _file->readSint32BE();
+		/* int32 u0 = */ chunk.readSint32BE();
 
 	// Offset for drawing in the x direction
 	if (size >= 8)
-		xOffset = _file->readSint32BE();
+		xOffset = chunk.readSint32BE();
 
 	// Offset for drawing in the y direction
 	if (size >= 12)
-		yOffset = _file->readSint32BE();
+		yOffset = chunk.readSint32BE();
 
 	if (_storedFrame && _buffer) {
+		byte *buffer = getDrawBuffer();
+
 		for (uint y = 0; y < _height; y++) {
 			int realY = yOffset + y;
 			if (realY < 0 || realY >= (int)_height)
@@ -577,7 +1222,7 @@ bool SMUSHVideo::handleFetch(uint32 size) {
 				if (realX < 0 || realX >= (int)_width)	
 					continue;
 
-				_buffer[realY * _pitch + realX] = _storedFrame[y * _pitch + x];
+				buffer[realY * _pitch + realX] = _storedFrame[y * _pitch + x];
 			}
 		}
 	}
@@ -585,30 +1230,43 @@ bool SMUSHVideo::handleFetch(uint32 size) {
 	return true;
 }
 
-void SMUSHVideo::decodeCodec1(SeekableReadStream *stream, int left, int top, uint width, uint height) {
+void SMUSHVideo::decodeCodec1(ByteCursor &chunk, int left, int top, uint width, uint height) {
 	// This is very similar to the bomp compression
+	byte *buffer = getDrawBuffer();
+
 	for (uint y = 0; y < height; y++) {
-		uint16 lineSize = stream->readUint16LE();
-		byte *dst = _buffer + (top + y) * _pitch + left;
+		uint16 lineSize = chunk.readUint16LE();
+
+		// Check the line against the chunk once, then decode it unchecked
+		if (lineSize > chunk.remaining())
+			lineSize = chunk.remaining();
+
+		const byte *src = chunk.getData();
+		const byte *srcEnd = src + lineSize;
+		chunk.skip(lineSize);
 
-		while (lineSize > 0) {
-			byte code = stream->readByte();
-			lineSize--;
+		byte *dst = buffer + (top + y) * _pitch + left;
+
+		while (src < srcEnd) {
+			byte code = *src++;
 			byte length = (code >> 1) + 1;
 
 			if (code & 1) {
-				byte val = stream->readByte();
-				lineSize--;
+				if (src == srcEnd)
+					break;
+
+				byte val = *src++;
 
 				if (val != 0)
 					memset(dst, val, length);
 
 				dst += length;
 			} else {
-				lineSize -= length;
+				if (length > srcEnd - src)
+					length = srcEnd - src;
 
 				while (length--) {
-					byte val = stream->readByte();
+					byte val = *src++;
 
 					if (val)
 						*dst = val;
@@ -677,16 +1335,16 @@ bool SMUSHVideo::readFrameHeader() {
 	return true;
 }
 
-bool SMUSHVideo::handleIACT(uint32 size) {
+bool SMUSHVideo::handleIACT(ByteCursor &chunk, uint32 size) {
 	// Handle interactive sequences
 
 	if (size < 8)
 		return false;
 
-	uint16 code = _file->readUint16LE();
-	uint16 flags = _file->readUint16LE();
-	/* int16 unknown = */ _file->readSint16LE();
-	uint16 trackFlags = _file->readUint16LE();
+	uint16 code = chunk.readUint16LE();
+	uint16 flags = chunk.readUint16LE();
+	/* int16 unknown = */ chunk.readSint16LE();
+	uint16 trackFlags = chunk.readUint16LE();
 
 	if (code == 8 && flags == 46) {
 		if (!_ranIACTSoundCheck)
@@ -695,7 +1353,7 @@ bool SMUSHVideo::handleIACT(uint32 size) {
 		if (_hasIACTSound) {
 			// Audio track
 			if (trackFlags == 0)
-				return bufferIACTAudio(size);
+				return bufferIACTAudio(chunk, size);
 		}
 	} if (code == 6 && flags == 38) {
 		// Clear frame? Seems to fix some RA2 videos
@@ -708,80 +1366,76 @@ bool SMUSHVideo::handleIACT(uint32 size) {
 	return true;
 }
 
-bool SMUSHVideo::bufferIACTAudio(uint32 size) {
+bool SMUSHVideo::bufferIACTAudio(ByteCursor &chunk, uint32 size) {
 	// Queue IACT audio (22050Hz)
 
-	if (!_iactStream) {
+	// Frames a seek skips over are still parsed, to keep track of where
+	// the blocks start, but not played
+	bool mute = _demuxedFrames < _audioFromFrame;
+
+	if (!_iactStream && !mute) {
 		// Ignore _audioRate since it's always 22050Hz
 		// and CMI often lies and says 11025Hz
-		_iactStream = makeQueuingAudioStream(22050, 2);
-		_audio->play(_iactStream);
+		_iactStream = makeRingAudioStream(22050, 2, kIACTBlockSamples, getIACTRingBlocks());
+		_iactRingFull = false;
+
+		if (!_audio->play(_iactStream)) {
+			// Go without the audio rather than fill a ring nobody reads
+			delete _iactStream;
+			_iactStream = 0;
+			_hasIACTSound = false;
+			return true;
+		}
+	}
+
+	if (!_iactBuffer) {
 		_iactPos = 0;
 		_iactBuffer = new byte[4096];
 	}
 
-	/* uint16 trackID = */ _file->readUint16LE();
-	/* uint16 index = */ _file->readUint16LE();
-	/* uint16 frameCount = */ _file->readUint16LE();
-	/* uint32 bytesLeft = */ _file->readUint32LE();
+	/* uint16 trackID = */ chunk.readUint16LE();
+	/* uint16 index = */ chunk.readUint16LE();
+	/* uint16 frameCount = */ chunk.readUint16LE();
+	/* uint32 bytesLeft = */ chunk.readUint32LE();
 	size -= 18;
 
 	while (size > 0) {
+		if (_iactPos == 0 && size >= 2 && chunk.remaining() >= 2) {
+			// A block that's whole in this chunk is decoded where it lies
+			const byte *block = chunk.getData();
+			uint32 length = ((block[0] << 8) | block[1]) + 2;
+
+			if (length <= size && length <= chunk.remaining()) {
+				queueIACTBlock(block + 2, mute);
+				chunk.skip(length);
+				size -= length;
+				continue;
+			}
+		}
+
 		if (_iactPos >= 2) {
 			uint32 length = READ_BE_UINT16(_iactBuffer) + 2;
 			length -= _iactPos;
 
 			if (length > size) {
-				_file->read(_iactBuffer + _iactPos, size);
+				chunk.read(_iactBuffer + _iactPos, size);
 				_iactPos += size;
 				size = 0;
 			} else {
-				byte *output = new byte[4096];
-
-				_file->read(_iactBuffer + _iactPos, length);
-
-				byte *dst = output;
-				byte *src = _iactBuffer + 2;
-
-				int count = 1024;
-				byte var1 = *src++;
-				byte var2 = var1 >> 4;
-				var1 &= 0xF;
-
-				while (count--) {
-					byte value = *src++;
-					if (value == 0x80) {
-						*dst++ = *src++;
-						*dst++ = *src++;
-					} else {
-						int16 val = (int8)value << var2;
-						*dst++ = val >> 8;
-						*dst++ = (byte)val;
-					}
-
-					value = *src++;
-					if (value == 0x80) {
-						*dst++ = *src++;
-						*dst++ = *src++;
-					} else {
-						int16 val = (int8)value << var1;
-						*dst++ = val >> 8;
-						*dst++ = (byte)val;
-					}
-				}
+				chunk.read(_iactBuffer + _iactPos, length);
+				queueIACTBlock(_iactBuffer + 2, mute);
 
-				_iactStream->queueAudioStream(makePCMStream(output, 4096, _iactStream->getRate(), _iactStream->getChannels(), FLAG_16BITS));
 				size -= length;
 				_iactPos = 0;
 			}
 		} else {
 			if (size > 1 && _iactPos == 0) {
-				_iactBuffer[0] = _file->readByte();
+				_iactBuffer[0] = chunk.readByte();
 				_iactPos = 1;
 				size--;
 			}
 
-			_iactBuffer[_iactPos] = _file->readByte();
+			_iactBuffer[_iactPos] = chunk.readByte();
 			_iactPos++;
 			size--;
 		}
@@ -790,6 +1444,34 @@ bool SMUSHVideo::bufferIACTAudio(uint32 size) {
 	return true;
 }
 
+void SMUSHVideo::queueIACTBlock(const byte *data, bool mute) {
+	if (mute)
+		return;
+
+	// Decode straight into the stream's ring
+	int16 *output = _iactStream->getWriteBlock();
+
+	if (output) {
+		decodeIACTBlock(output, data);
+		_iactStream->commitWriteBlock();
+	} else if (!_iactRingFull) {
+		// Once per stream; a host that never reads audio would hit this
+		// for every block
+		fprintf(stderr, "IACT audio ring full, dropping blocks\n");
+		_iactRingFull = true;
+	}
+}
+
+uint SMUSHVideo::getIACTRingBlocks() const {
+	// Room for everything demuxed and decoded ahead of the screen, plus a
+	// second for what the host buffers on its side
+	uint32 aheadTime = 1000;
+	if (_frameRate != 0)
+		aheadTime += getNextFrameTime(_demuxAhead + _aheadDepth);
+
+	return aheadTime * 22050 / 1000 / (kIACTBlockSamples / 2) + 1;
+}
+
 bool SMUSHVideo::detectFrameSize() {
 	// There is no frame size, so we'll be using a heuristic to detect it.
 
@@ -802,34 +1484,22 @@ bool SMUSHVideo::detectFrameSize() {
 	// Most of this is for detecting the total frame size of a Rebel Assault
 	// video which is a lot harder.
 
-	uint32 startPos = _file->pos();
 	bool done = false;
 
 	// Only go through a certain amount of frames
-	uint32 maxFrames = 20;
-	if (maxFrames > _frameCount)
-		maxFrames = _frameCount;
+	uint32 maxFrames = kFrameSizeProbeFrames;
+	if (maxFrames > _frameIndex.size())
+		maxFrames = _frameIndex.size();
 
 	for (uint i = 0; i < maxFrames && !done; i++) {
-		if (_file->readUint32BE() != MKTAG('F', 'R', 'M', 'E'))
-			return false;
+		const FrameEntry &entry = _frameIndex[i];
 
-		uint32 frameSize = _file->readUint32BE();
-		uint32 bytesLeft = frameSize;
+		for (uint32 j = 0; j < entry.chunkCount; j++) {
+			const ChunkEntry &chunk = _chunkIndex[entry.firstChunk + j];
 
-		while (bytesLeft > 0) {
-			uint32 subType = _file->readUint32BE();
-			uint32 subSize = _file->readUint32BE();
-			uint32 subPos = _file->pos();
-
-			if (_file->eos()) {
-				// HACK: L2PLAY.ANM from Rebel Assault seems to have an unaligned FOBJ :/
-				fprintf(stderr, "Unexpected end of file!\n");
-				return false;
-			}
-
-			if (subType == MKTAG('F', 'O', 'B', 'J')) {
+			if (chunk.tag == MKTAG('F', 'O', 'B', 'J')) {
 				SeekableReadStream *stream = _file;
+				stream->seek(entry.offset + chunk.offset, SEEK_SET);
 
 				byte codec = stream->readByte();
 				/* byte codecParam = */ stream->readByte();
@@ -875,22 +1545,29 @@ bool SMUSHVideo::detectFrameSize() {
 				if (done)
 					break;
 			}
-
-			bytesLeft -= subSize + 8 + (subSize & 1);
-			_file->seek(subPos + subSize + (subSize & 1), SEEK_SET);
 		}
 	}
 
 	if (_width == 0 || _height == 0)
 		return false;
 
-	_file->seek(startPos, SEEK_SET);
 	_pitch = _width;
 	_buffer = new byte[_pitch * _height];
 	memset(_buffer, 0, _pitch * _height); // FIXME: Is this right?
+	_frame = _buffer;
 	return true;
 }
 
+byte *SMUSHVideo::getDrawBuffer() {
+	// Codecs that draw over the previous frame need it in _buffer first
+	if (_frame != _buffer) {
+		memcpy(_buffer, _frame, _pitch * _height);
+		_frame = _buffer;
+	}
+
+	return _buffer;
+}
+
 SMUSHChannel *SMUSHVideo::findAudioTrack(const SMUSHTrackHandle &track) {
 	ChannelMap::iterator it = _audioTracks.find(track);
 
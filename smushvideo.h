@@ -26,16 +26,20 @@
 #ifndef SMUSHVIDEO_H
 #define SMUSHVIDEO_H
 
+#include <deque>
 #include <map>
+#include <vector>
+#include "codec48.h"
 #include "graphicsman.h"
 #include "types.h"
 
 class AudioManager;
+class ByteCursor;
 class Blocky16;
-class Codec48Decoder;
 class SeekableReadStream;
 class SMUSHChannel;
-class QueuingAudioStream;
+class PushReadStream;
+class RingAudioStream;
 
 struct SMUSHTrackHandle {
 	uint32 type;
@@ -50,7 +54,15 @@ public:
 	SMUSHVideo(AudioManager &audio);
 	~SMUSHVideo();
 
-	bool load(void* buf, int len);
+	/** Load from a stream, which the video takes ownership of. */
+	bool load(SeekableReadStream *stream);
+
+	/**
+	 * Load from a stream the host is still feeding. The header has to be
+	 * in it already. Frames that haven't arrived yet hold playback back,
+	 * and data is released from the stream once demuxed.
+	 */
+	bool loadStreaming(PushReadStream *stream);
 	void close();
 	bool isLoaded() const { return _file != 0; }
 	int frame(GraphicsManager &gfx);
@@ -61,16 +73,48 @@ public:
 	uint getHeight() const;
 	uint getNumFrames() const;
 	double getFPS() const;
+	uint getAudioRate() const;
+
+	int getCutsceneStringId() const { return _shownStringId; }
+
+	/** Threads to split codec48 frames across (0 = one per processor) */
+	void setDecodeThreads(int threads);
+
+	/**
+	 * Decode up to the given number of frames ahead on a worker thread,
+	 * using no more than maxMegabytes for the finished frames. frame()
+	 * then only picks up frames the worker already finished. 0 frames
+	 * decodes inline. Only possible before playback starts; returns how
+	 * many frames ahead will be decoded.
+	 */
+	int setDecodeAhead(int frames, int maxMegabytes);
+
+	/**
+	 * Snapshot the decoder every interval frames as they're decoded, in no
+	 * more than maxMegabytes. Past the budget every other snapshot is
+	 * dropped and the interval doubles. An interval of 0 only keeps the
+	 * start. Only possible before playback starts.
+	 */
+	void setSeekSnapshots(int interval, int maxMegabytes);
 
-	int getCutsceneStringId() const { return cutscene_string_id; }
+	/**
+	 * Continue playback at the given frame by decoding forward from the
+	 * nearest snapshot before it. gfx is left showing the frame before;
+	 * the next frame() shows the frame itself. Streamed loads can't seek.
+	 * Returns the frame landed on, or -1.
+	 */
+	int seek(GraphicsManager &gfx, uint frame);
+	uint getFrameAtTime(uint32 time) const;
 
 private:
 	uint32 lastFrameTick;
 	uint curFrame;
 
 	int cutscene_string_id;
+	int _shownStringId; // cutscene_string_id of the frame last returned by frame()
 
 	SeekableReadStream *_file;
+	PushReadStream *_pushStream; // _file when streaming, otherwise null
 	uint _frameRate;
 
 	// Header
@@ -86,10 +130,109 @@ private:
 	uint _width, _height, _pitch;
 	bool detectFrameSize();
 
+	// How many frames detectFrameSize() looks at; they're indexed at load
+	enum { kFrameSizeProbeFrames = 20 };
+
+	// The current frame: either _buffer or the codec48 output surface
+	const byte *_frame;
+	byte *getDrawBuffer();
+
 	// Stored Frame
 	bool _storeFrame;
 	byte *_storedFrame;
 
+	// Decode Ahead
+	struct AheadSlot {
+		GraphicsManager *gfx;
+		int stringId;
+	};
+
+	AheadSlot *_aheadSlots;
+	int _aheadDepth;
+	volatile LONG _aheadRead, _aheadWrite;
+	uint _aheadStart;
+	HANDLE _aheadThread, _aheadWake;
+	volatile bool _aheadQuit;
+	GraphicsManager *_aheadGfx;
+	void startDecodeAhead();
+	void stopDecodeAhead();
+	void decodeAhead();
+	static DWORD WINAPI decodeAheadProc(LPVOID param);
+
+	// Frame Index
+	struct ChunkEntry {
+		uint32 tag;
+		uint32 offset; // of the chunk data, from the start of the FRME payload
+		uint32 size;
+	};
+
+	struct FrameEntry {
+		uint32 offset; // of the FRME payload in _file
+		uint32 size;
+		uint32 firstChunk; // into _chunkIndex
+		uint32 chunkCount;
+		bool truncated; // ends partway into a chunk header
+	};
+
+	std::vector<FrameEntry> _frameIndex;
+	std::vector<ChunkEntry> _chunkIndex;
+	uint32 _indexEnd; // where the next unindexed frame starts
+	void buildIndex(uint frames);
+	bool indexFrame();
+
+	// Demuxer
+	enum {
+		// Zeros after each packet, so decoding in place can load a vector
+		// past the end of the last chunk
+		kPacketPadding = 16
+	};
+
+	struct FramePacket {
+		byte *data; // FRME payload, audio already queued
+		uint32 size;
+		uint32 frame;
+	};
+
+	std::deque<FramePacket> _videoPackets;
+	uint _demuxedFrames, _demuxAhead;
+	bool demuxFrame();
+	bool hasUnindexedFrame();
+	bool isFrameAvailable();
+	bool isStarved();
+	void clearPackets();
+
+	// Seeking
+	struct IACTState {
+		uint frame;
+		uint32 pos;
+		byte *buffer; // the partly read block, or null
+	};
+
+	struct Snapshot {
+		byte palette[256 * 3];
+		uint16 deltaPalette[256 * 3];
+		byte *buffer; // null while the codec48 output is shown
+		byte *storedFrame;
+		bool storeFrame;
+		bool frameIsCodec48;
+		int stringId;
+		Codec48Decoder::State *codec48;
+		IACTState iact;
+		uint32 bytes;
+	};
+
+	typedef std::map<uint, Snapshot *> SnapshotMap;
+	SnapshotMap _snapshots;
+	std::deque<IACTState> _pendingIACT; // recorded by demuxFrame() for frames to snapshot
+	uint _snapshotInterval;
+	uint32 _snapshotBudget, _snapshotBytes;
+	uint _audioFromFrame; // IACT audio of earlier frames is parsed but not played
+	bool isSnapshotFrame(uint frame) const;
+	void takeSnapshot(uint frame);
+	void restoreSnapshot(GraphicsManager &gfx, const Snapshot &snapshot);
+	void freeSnapshot(Snapshot *snapshot);
+	void clearSnapshots();
+
 	// Main Functions
 	bool readHeader();
 	bool handleFrame(GraphicsManager &gfx);
@@ -97,19 +240,20 @@ private:
 	uint32 getNextFrameTime(uint32 curFrame) const;
 
 	// Frame Types
-	bool handleFrameObject(GraphicsManager &gfx, uint32 size);
-	bool handleFetch(uint32 size);
-	bool handleIACT(uint32 size);
-	bool handleNewPalette(GraphicsManager &gfx, uint32 size);
+	bool handleFrameObject(GraphicsManager &gfx, ByteCursor &chunk, uint32 size);
+	bool handleFetch(ByteCursor &chunk, uint32 size);
+	bool handleIACT(ByteCursor &chunk, uint32 size);
+	bool handleNewPalette(GraphicsManager &gfx, ByteCursor &chunk, uint32 size);
 	bool handleStore(uint32 size);
-	bool handleText(uint32 type, uint32 size);
-	bool handleDeltaPalette(GraphicsManager &gfx, uint32 size);
+	bool handleText(ByteCursor &chunk, uint32 type, uint32 size);
+	bool handleDeltaPalette(GraphicsManager &gfx, ByteCursor &chunk, uint32 size);
 	bool handleSoundFrame(uint32 type, uint32 size);
 
 	// Codecs
-	bool handleFrameObject(GraphicsManager &gfx, SeekableReadStream *stream, uint32 size);
-	void decodeCodec1(SeekableReadStream *stream, int left, int top, uint width, uint height);
+	void decodeCodec1(ByteCursor &chunk, int left, int top, uint width, uint height);
 	Codec48Decoder *_codec48;
+	int _decodeThreads;
+	bool _shownCodec48; // the last blit was the codec48 output, so its dirty map applies
 
 	// Sound
 	bool _oldSoundHeader, _runSoundHeaderCheck;
@@ -117,9 +261,12 @@ private:
 	uint _audioRate, _audioChannels;
 	void detectSoundHeaderType();
 	void detectIACTType(uint32 flags);
-	bool bufferIACTAudio(uint32 size);
+	bool bufferIACTAudio(ByteCursor &chunk, uint32 size);
+	void queueIACTBlock(const byte *data, bool mute);
+	uint getIACTRingBlocks() const;
 	AudioManager *_audio;
-	QueuingAudioStream *_iactStream;
+	RingAudioStream *_iactStream;
+	bool _iactRingFull; // warned about dropping blocks into this stream
 	byte *_iactBuffer;
 	uint32 _iactPos;
 	SMUSHChannel *findAudioTrack(const SMUSHTrackHandle &track);
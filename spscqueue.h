@@ -0,0 +1,103 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include "types.h"
+#include <Windows.h>
+
+/**
+ * An unbounded queue with one thread pushing and another popping, neither
+ * of which ever waits on the other. Only the pushing thread allocates or
+ * frees nodes: it frees the ones already popped on its next push(), so the
+ * popping thread (the audio callback) never touches the heap.
+ */
+template<typename T>
+class SPSCQueue {
+public:
+	SPSCQueue() {
+		_first = _head = _tail = new Node();
+		_tail->next = 0;
+	}
+
+	~SPSCQueue() {
+		while (_first) {
+			Node *next = _first->next;
+			delete _first;
+			_first = next;
+		}
+	}
+
+	/** Add a value at the back. Pushing thread only. */
+	void push(const T &value) {
+		Node *node = new Node();
+		node->value = value;
+		node->next = 0;
+
+		// The value has to be visible before the node is
+		MemoryBarrier();
+		_tail->next = node;
+		_tail = node;
+
+		// Free what was popped since last time, up to the popper's current node
+		Node *head = _head;
+		MemoryBarrier();
+
+		while (_first != head) {
+			Node *next = _first->next;
+			delete _first;
+			_first = next;
+		}
+	}
+
+	/** Whether there is nothing to pop. Popping thread only. */
+	bool empty() const { return _head->next == 0; }
+
+	/** The value at the front; the queue must not be empty. Popping thread only. */
+	T &front() {
+		Node *node = _head->next;
+		MemoryBarrier();
+		return node->value;
+	}
+
+	/** Drop the value at the front. Popping thread only. */
+	void pop() {
+		MemoryBarrier();
+		_head = _head->next;
+	}
+
+private:
+	struct Node {
+		T value;
+		Node *volatile next;
+	};
+
+	Node *_first;         // oldest node not freed yet (pushing thread)
+	Node *volatile _head; // node of the last popped value (popping thread)
+	Node *_tail;          // newest node (pushing thread)
+
+	SPSCQueue(const SPSCQueue &);
+	SPSCQueue &operator=(const SPSCQueue &);
+};
+
+#endif
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string>
+#include <Windows.h>
 #include "stream.h"
 
 uint32 MemoryReadStream::read(void *dataPtr, uint32 dataSize) {
@@ -68,6 +69,132 @@ bool MemoryReadStream::seek(int32 offs, int whence) {
 	return true;	// FIXME: STREAM REWRITE
 }
 
+PushReadStream::PushReadStream(uint32 window) : _base(0), _released(0), _appended(0), _window(window), _finished(false), _pos(0), _eos(false) {
+	InitializeCriticalSection(&_lock);
+}
+
+PushReadStream::~PushReadStream() {
+	for (std::deque<byte *>::iterator it = _blocks.begin(); it != _blocks.end(); it++)
+		delete[] *it;
+
+	DeleteCriticalSection(&_lock);
+}
+
+uint32 PushReadStream::append(const void *dataPtr, uint32 dataSize) {
+	EnterCriticalSection(&_lock);
+
+	// Counted from what was released rather than the block it falls in, so
+	// the window always has room for a whole frame past the demux position
+	uint32 held = _appended - _released;
+	if (_finished || held >= _window)
+		dataSize = 0;
+	else if (dataSize > _window - held)
+		dataSize = _window - held;
+
+	const byte *src = (const byte *)dataPtr;
+	uint32 left = dataSize;
+
+	while (left > 0) {
+		uint32 offset = (_appended - _base) % kBlockSize;
+		if (offset == 0)
+			_blocks.push_back(new byte[kBlockSize]);
+
+		uint32 chunk = MIN<uint32>(kBlockSize - offset, left);
+		memcpy(_blocks.back() + offset, src, chunk);
+
+		src += chunk;
+		left -= chunk;
+		_appended += chunk;
+	}
+
+	LeaveCriticalSection(&_lock);
+	return dataSize;
+}
+
+void PushReadStream::finish() {
+	EnterCriticalSection(&_lock);
+	_finished = true;
+	LeaveCriticalSection(&_lock);
+}
+
+bool PushReadStream::isAvailable(uint32 end) const {
+	EnterCriticalSection(&_lock);
+	bool available = _finished || end <= _appended;
+	LeaveCriticalSection(&_lock);
+
+	return available;
+}
+
+void PushReadStream::release(uint32 pos) {
+	EnterCriticalSection(&_lock);
+
+	if (pos > _released)
+		_released = MIN(pos, _appended);
+
+	// Only whole blocks go, so the one holding pos stays
+	while (!_blocks.empty() && _base + kBlockSize <= pos && _base + kBlockSize <= _appended) {
+		delete[] _blocks.front();
+		_blocks.pop_front();
+		_base += kBlockSize;
+	}
+
+	LeaveCriticalSection(&_lock);
+}
+
+uint32 PushReadStream::read(void *dataPtr, uint32 dataSize) {
+	EnterCriticalSection(&_lock);
+
+	uint32 available = (_pos >= _base && _pos < _appended) ? _appended - _pos : 0;
+	if (dataSize > available) {
+		dataSize = available;
+		_eos = true;
+	}
+
+	byte *dst = (byte *)dataPtr;
+	uint32 left = dataSize;
+
+	while (left > 0) {
+		uint32 offset = _pos - _base;
+		uint32 chunk = MIN<uint32>(kBlockSize - offset % kBlockSize, left);
+		memcpy(dst, _blocks[offset / kBlockSize] + offset % kBlockSize, chunk);
+
+		dst += chunk;
+		left -= chunk;
+		_pos += chunk;
+	}
+
+	LeaveCriticalSection(&_lock);
+	return dataSize;
+}
+
+int32 PushReadStream::size() const {
+	EnterCriticalSection(&_lock);
+	uint32 size = _appended;
+	LeaveCriticalSection(&_lock);
+
+	return size;
+}
+
+bool PushReadStream::seek(int32 offs, int whence) {
+	int32 newPos = offs;
+	if (whence == SEEK_CUR)
+		newPos += _pos;
+	else if (whence == SEEK_END)
+		newPos += size();
+
+	// Released data is gone; going past what has arrived is fine
+	EnterCriticalSection(&_lock);
+	bool valid = newPos >= 0 && (uint32)newPos >= _base;
+	LeaveCriticalSection(&_lock);
+
+	if (!valid)
+		return false;
+
+	_pos = newPos;
+	_eos = false;
+	return true;
+}
+
 class StdioStream : public SeekableReadStream {
 public:
 	StdioStream() {}
@@ -153,13 +280,138 @@ SeekableReadStream *createReadStream(const char *pathName) {
 	return new StdioStream(file);
 }
 
-SeekableReadStream *createReadStream(void* buf, int len) {
+SeekableReadStream *createReadStream(void* buf, int len, bool copy) {
+	if (!copy)
+		return new MemoryReadStream((const byte*)buf, (uint32)len);
+
 	void* cpy = new char[len];
 	memcpy(cpy, buf, len);
 
 	return new MemoryReadStream((byte*)cpy, (uint32)len, true);
 }
 
+/**
+ * A read-only view of a whole file. Pages fault in as they're first read,
+ * and the next stretch past the read position is handed to
+ * PrefetchVirtualMemory so the demuxer rarely waits on the disk.
+ */
+class MappedReadStream : public MemoryReadStream {
+public:
+	MappedReadStream(HANDLE file, HANDLE mapping, const byte *view, uint32 size);
+	~MappedReadStream();
+
+	uint32 read(void *dataPtr, uint32 dataSize);
+	bool seek(int32 offs, int whence = SEEK_SET);
+
+private:
+	enum { kPrefetchWindow = 1024 * 1024 };
+
+	void prefetch(uint32 end);
+
+	HANDLE _fileHandle, _mapping;
+	const byte *_view;
+	uint32 _prefetched; // bytes up to here have already been hinted
+};
+
+// PrefetchVirtualMemory only exists from Windows 8 on, so look it up at run time
+struct PrefetchRange {
+	PVOID address;
+	SIZE_T size;
+};
+
+typedef BOOL (WINAPI *PrefetchVirtualMemoryProc)(HANDLE process, ULONG_PTR count, PrefetchRange *ranges, DWORD flags);
+
+static PrefetchVirtualMemoryProc getPrefetchVirtualMemory() {
+	static volatile LONG s_resolved = 0;
+	static PrefetchVirtualMemoryProc s_proc = 0;
+
+	if (!s_resolved) {
+		HMODULE kernel = GetModuleHandleA("kernel32.dll");
+		s_proc = kernel ? (PrefetchVirtualMemoryProc)GetProcAddress(kernel, "PrefetchVirtualMemory") : 0;
+		MemoryBarrier();
+		s_resolved = 1;
+	}
+
+	return s_proc;
+}
+
+MappedReadStream::MappedReadStream(HANDLE file, HANDLE mapping, const byte *view, uint32 size) :
+		MemoryReadStream(view, size), _fileHandle(file), _mapping(mapping), _view(view), _prefetched(0) {
+	prefetch(kPrefetchWindow);
+}
+
+MappedReadStream::~MappedReadStream() {
+	UnmapViewOfFile(_view);
+	CloseHandle(_mapping);
+	CloseHandle(_fileHandle);
+}
+
+void MappedReadStream::prefetch(uint32 end) {
+	if (end > (uint32)size())
+		end = size();
+
+	if (end <= _prefetched)
+		return;
+
+	PrefetchVirtualMemoryProc prefetchProc = getPrefetchVirtualMemory();
+	if (prefetchProc) {
+		PrefetchRange range;
+		range.address = (PVOID)(_view + _prefetched);
+		range.size = end - _prefetched;
+		prefetchProc(GetCurrentProcess(), 1, &range, 0);
+	}
+
+	_prefetched = end;
+}
+
+uint32 MappedReadStream::read(void *dataPtr, uint32 dataSize) {
+	// Keep at least half a window hinted past the end of this read
+	uint32 end = pos() + dataSize;
+	if (end + kPrefetchWindow / 2 > _prefetched)
+		prefetch(end + kPrefetchWindow);
+
+	return MemoryReadStream::read(dataPtr, dataSize);
+}
+
+bool MappedReadStream::seek(int32 offs, int whence) {
+	bool result = MemoryReadStream::seek(offs, whence);
+
+	// Jumping outside the hinted stretch restarts it at the new position
+	uint32 newPos = pos();
+	if (newPos > _prefetched || newPos + kPrefetchWindow < _prefetched)
+		_prefetched = newPos;
+
+	return result;
+}
+
+SeekableReadStream *createMappedReadStream(const char *pathName) {
+	HANDLE file = CreateFileA(pathName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// Empty files can't be mapped, and positions are 32-bit
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 || fileSize.QuadPart > 0x7FFFFFFF) {
+		CloseHandle(file);
+		return 0;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping) {
+		CloseHandle(file);
+		return 0;
+	}
+
+	const byte *view = (const byte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return 0;
+	}
+
+	return new MappedReadStream(file, mapping, view, (uint32)fileSize.QuadPart);
+}
+
 SeekableReadStream *wrapCompressedReadStream(SeekableReadStream *toBeWrapped) {
 	if (toBeWrapped) {
 		uint16 header = toBeWrapped->readUint16BE();
@@ -167,8 +419,12 @@ SeekableReadStream *wrapCompressedReadStream(SeekableReadStream *toBeWrapped) {
 				     ((header & 0x0F00) == 0x0800 &&
 				      header % 31 == 0));
 		toBeWrapped->seek(-2, SEEK_CUR);
-		if (isCompressed)
+		if (isCompressed) {
+			// No GZipReadStream here, so there's nothing to hand the stream to
+			fprintf(stderr, "Compressed SMUSH files are not supported\n");
+			delete toBeWrapped;
 			return nullptr;//new GZipReadStream(toBeWrapped);
+		}
 	}
 
 	return toBeWrapped;
@@ -25,6 +25,9 @@
 #ifndef STREAM_H
 #define STREAM_H
 
+#include <deque>
+#include <string.h>
+#include <Windows.h>
 #include "util.h"
 
 /**
@@ -250,6 +253,109 @@ public:
 	virtual bool seek(int32 offset, int whence = SEEK_SET) = 0;
 };
 
+/**
+ * A reader over a chunk that is already in memory. Nothing is virtual and
+ * the endian reads are inline, so it's cheap enough for per-pixel and
+ * per-sample parsing. The bounds are fixed when it's made; reading past
+ * them returns zeros and sets eos() rather than reading further.
+ */
+class ByteCursor {
+public:
+	ByteCursor() : _start(0), _ptr(0), _end(0), _eos(false) {}
+	ByteCursor(const byte *data, uint32 size) : _start(data), _ptr(data), _end(data + size), _eos(false) {}
+
+	uint32 size() const { return (uint32)(_end - _start); }
+	uint32 pos() const { return (uint32)(_ptr - _start); }
+	uint32 remaining() const { return (uint32)(_end - _ptr); }
+	bool eos() const { return _eos; }
+
+	/** The data at the current position, of which remaining() bytes are valid */
+	const byte *getData() const { return _ptr; }
+
+	void skip(uint32 count) {
+		if (count > remaining()) {
+			count = remaining();
+			_eos = true;
+		}
+
+		_ptr += count;
+	}
+
+	uint32 read(void *dataPtr, uint32 dataSize) {
+		if (dataSize > remaining()) {
+			dataSize = remaining();
+			_eos = true;
+		}
+
+		memcpy(dataPtr, _ptr, dataSize);
+		_ptr += dataSize;
+		return dataSize;
+	}
+
+	byte readByte() {
+		if (_ptr == _end) {
+			_eos = true;
+			return 0;
+		}
+
+		return *_ptr++;
+	}
+
+	uint16 readUint16LE() {
+		if (!has(2))
+			return 0;
+
+		uint16 val = _ptr[0] | (_ptr[1] << 8);
+		_ptr += 2;
+		return val;
+	}
+
+	uint32 readUint32LE() {
+		if (!has(4))
+			return 0;
+
+		uint32 val = _ptr[0] | (_ptr[1] << 8) | (_ptr[2] << 16) | ((uint32)_ptr[3] << 24);
+		_ptr += 4;
+		return val;
+	}
+
+	uint16 readUint16BE() {
+		if (!has(2))
+			return 0;
+
+		uint16 val = (_ptr[0] << 8) | _ptr[1];
+		_ptr += 2;
+		return val;
+	}
+
+	uint32 readUint32BE() {
+		if (!has(4))
+			return 0;
+
+		uint32 val = ((uint32)_ptr[0] << 24) | (_ptr[1] << 16) | (_ptr[2] << 8) | _ptr[3];
+		_ptr += 4;
+		return val;
+	}
+
+	int16 readSint16LE() { return (int16)readUint16LE(); }
+	int32 readSint32LE() { return (int32)readUint32LE(); }
+	int16 readSint16BE() { return (int16)readUint16BE(); }
+	int32 readSint32BE() { return (int32)readUint32BE(); }
+
+private:
+	bool has(uint32 count) {
+		if (remaining() >= count)
+			return true;
+
+		_ptr = _end;
+		_eos = true;
+		return false;
+	}
+
+	const byte *_start, *_ptr, *_end;
+	bool _eos;
+};
+
 /**
  * Simple memory based 'stream', which implements the SeekableReadStream interface for
  * a plain memory block.
@@ -284,6 +390,12 @@ public:
 
 	bool seek(int32 offs, int whence = SEEK_SET);
 
+	/**
+	 * A cursor over the next size bytes, or as many as are left. The
+	 * stream's own position doesn't move.
+	 */
+	ByteCursor getCursor(uint32 size) const { return ByteCursor(_ptr, MIN(size, _size - _pos)); }
+
 private:
 	const byte * const _ptrOrig;
 	const byte *_ptr;
@@ -293,17 +405,87 @@ private:
 	bool _eos;
 };
 
+/**
+ * A stream the host feeds piece by piece while it is being read. Only a
+ * window of data is held: append() takes what fits, and release() frees
+ * everything the reader no longer needs. Reading past the data appended so
+ * far returns short, so readers check isAvailable() first.
+ *
+ * append(), finish() and isAvailable() may be called from any thread; the
+ * rest belongs to the reader.
+ */
+class PushReadStream : public SeekableReadStream {
+public:
+	PushReadStream(uint32 window);
+	~PushReadStream();
+
+	/** Copy in as much of the data as the window allows; returns how much. */
+	uint32 append(const void *dataPtr, uint32 dataSize);
+
+	/** No more data is coming; everything is available from now on. */
+	void finish();
+
+	/** Whether the bytes up to end have arrived (or never will). */
+	bool isAvailable(uint32 end) const;
+
+	/**
+	 * Free the data before pos and stop counting it against the window.
+	 * Seeking back there fails afterwards.
+	 */
+	void release(uint32 pos);
+
+	uint32 read(void *dataPtr, uint32 dataSize);
+
+	bool eos() const { return _eos; }
+	void clearErr() { _eos = false; }
+
+	int32 pos() const { return _pos; }
+	int32 size() const;
+
+	bool seek(int32 offs, int whence = SEEK_SET);
+
+private:
+	// Prevent copying instances by accident
+	PushReadStream(const PushReadStream &);
+	PushReadStream &operator=(const PushReadStream &);
+
+	enum { kBlockSize = 64 * 1024 };
+
+	mutable CRITICAL_SECTION _lock;
+	std::deque<byte *> _blocks;
+	uint32 _base;     // stream position of the first block
+	uint32 _released; // stream position passed to release(); the window starts here
+	uint32 _appended; // stream position the next append() lands at
+	uint32 _window;
+	bool _finished;
+
+	uint32 _pos;
+	bool _eos;
+};
+
 /** Open a file with a given path. */
 SeekableReadStream *createReadStream(const char *pathName);
 
-SeekableReadStream *createReadStream(void* buf, int len);
+/**
+ * Read from a block of memory. With copy set the stream works on its own
+ * copy of the data; otherwise it reads buf in place, and buf must stay
+ * valid and unchanged until the stream is deleted.
+ */
+SeekableReadStream *createReadStream(void* buf, int len, bool copy = true);
+
+/**
+ * Map a whole file read-only and read it in place. Returns NULL if the file
+ * can't be opened or mapped.
+ */
+SeekableReadStream *createMappedReadStream(const char *pathName);
 
 /**
  * Take an arbitrary SeekableReadStream and wrap it in a custom stream which
  * provides transparent on-the-fly decompression. Assumes the data it
  * retrieves from the wrapped stream to be either uncompressed or in gzip
  * format. In the former case, the original stream is returned unmodified
- * (and in particular, not wrapped).
+ * (and in particular, not wrapped). Decompression isn't built in, so
+ * gzip/zlib data is rejected: the stream is deleted and NULL returned.
  *
  * It is safe to call this with a NULL parameter (in this case, NULL is
  * returned).
@@ -0,0 +1,114 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "util.h"
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(int threadCount) {
+	_threadCount = threadCount;
+	_quit = false;
+	_job = 0;
+	_param = 0;
+	_count = _next = _remaining = 0;
+
+	_wake = CreateSemaphore(0, 0, 0x7FFFFFFF, 0);
+	_done = CreateEvent(0, FALSE, FALSE, 0);
+
+	_threads = new HANDLE[_threadCount];
+	for (int i = 0; i < _threadCount; i++)
+		_threads[i] = CreateThread(0, 0, threadProc, this, 0, 0);
+}
+
+WorkerPool::~WorkerPool() {
+	_quit = true;
+	ReleaseSemaphore(_wake, _threadCount, 0);
+
+	for (int i = 0; i < _threadCount; i++) {
+		WaitForSingleObject(_threads[i], INFINITE);
+		CloseHandle(_threads[i]);
+	}
+
+	delete[] _threads;
+	CloseHandle(_wake);
+	CloseHandle(_done);
+}
+
+int WorkerPool::getProcessorCount() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return MAX<int>(info.dwNumberOfProcessors, 1);
+}
+
+void WorkerPool::run(Job job, void *param, int count) {
+	if (count <= 0)
+		return;
+
+	int helpers = MIN(count - 1, _threadCount);
+
+	_job = job;
+	_param = param;
+	_count = count;
+	_next = 0;
+
+	// The batch is over once every job has run and every woken thread has
+	// gone back to waiting, so no thread is still looking at it when the
+	// next one gets set up.
+	_remaining = count + helpers;
+
+	if (helpers > 0)
+		ReleaseSemaphore(_wake, helpers, 0);
+
+	runJobs();
+	WaitForSingleObject(_done, INFINITE);
+}
+
+void WorkerPool::runJobs() {
+	for (;;) {
+		LONG index = InterlockedIncrement(&_next) - 1;
+		if (index >= _count)
+			break;
+
+		_job(_param, index);
+		finishOne();
+	}
+}
+
+void WorkerPool::finishOne() {
+	if (InterlockedDecrement(&_remaining) == 0)
+		SetEvent(_done);
+}
+
+DWORD WINAPI WorkerPool::threadProc(LPVOID param) {
+	WorkerPool *pool = (WorkerPool *)param;
+
+	for (;;) {
+		WaitForSingleObject(pool->_wake, INFINITE);
+
+		if (pool->_quit)
+			break;
+
+		pool->runJobs();
+		pool->finishOne();
+	}
+
+	return 0;
+}
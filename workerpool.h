@@ -0,0 +1,71 @@
+/* smushplay - A simple LucasArts SMUSH video player
+ *
+ * smushplay is the legal property of its developers, whose names can be
+ * found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include "types.h"
+#include <Windows.h>
+
+/**
+ * A fixed set of threads that run batches of indexed jobs. The thread
+ * calling run() works on the batch too, so a pool of N threads keeps N + 1
+ * cores busy.
+ */
+class WorkerPool {
+public:
+	typedef void (*Job)(void *param, int index);
+
+	WorkerPool(int threadCount);
+	~WorkerPool();
+
+	int getThreadCount() const { return _threadCount; }
+
+	/**
+	 * Call job(param, i) for every i in [0, count) and return once all of
+	 * them have finished. Not reentrant; a pool runs one batch at a time.
+	 */
+	void run(Job job, void *param, int count);
+
+	/** Number of logical processors in the machine. */
+	static int getProcessorCount();
+
+private:
+	static DWORD WINAPI threadProc(LPVOID param);
+	void runJobs();
+	void finishOne();
+
+	HANDLE *_threads;
+	int _threadCount;
+
+	HANDLE _wake;
+	HANDLE _done;
+	volatile bool _quit;
+
+	Job _job;
+	void *_param;
+	LONG _count;
+	volatile LONG _next;
+	volatile LONG _remaining;
+};
+
+#endif